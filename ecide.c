@@ -37,8 +37,6 @@
  * via a common point.
  *
  * FIXME/TODO:
- * - Support IRQs on interfaces that have IRQs (e.g. Castle)
- *   - This would include specialisations for card-specific masking
  * - Detect and support 8b interfaces
  * - Find a way to be initialised without a podule being probed, for A5000-like HW
  *
@@ -112,11 +110,77 @@
 /* finally the include file defining our own device */
 #include "ecide.h"
 #include "ecide_io.h"
+#include "ecide_ataregs.h"
+#include "ecide_cache.h"
+
+/* All cards queue requests (see ecide_enqueue()), and ecide_dispatch()
+ * keeps every card busy.  Cards that can interrupt (currently Castle)
+ * transfer via start_drive() and ecide_irq_handler().  Others are polled:
+ * by the dispatcher and softclock, or synchronously in ecide_run_polled()
+ * if ecide_async_poll is clear.
+ */
+#define SUPPORT_IRQS yes
 
-#define PIO_POLLED yes
+/* Period (ticks) of the lost-IRQ watchdog, and how many periods without
+ * progress before the card's transfer is failed: a period more than the
+ * drive's allowed (see ide_xfer_tmo()), so IDE_TMO_LONG for a command's
+ * first block.
+ */
+#define ECIDE_WDOG_TICKS        (hz)
+#define ECIDE_WDOG_STALLS(ih)   ((int)(ide_xfer_tmo(&(ih)->xfer)/1000) + 1)
 
 char *ecide_ident = "ecide IDE driver v0.2, (c) 2022 Matt Evans";
 
+/*
+ * Tunables (outside the scavenged region, see below, so they can be
+ * patched via /dev/kmem):
+ *
+ * ecide_async_poll: if set, ecide_strategy() only queues and starts requests
+ * for cards without IRQs (see ecide_kick()), and ecide_dispatch() does the
+ * rest of the transfers in the background.
+ * If clear, the caller waits while the transfer is done.
+ *
+ * ecide_pio_slice: the most sectors that one run of ecide_dispatch() moves
+ * for a card before leaving the rest to the next tick.  (It'll finish a DRQ block,
+ * so may go over by up to a block.)
+ */
+int ecide_async_poll = 1;
+int ecide_pio_slice = 32;
+
+/*
+ * ecide_cache_kb: size of the sector cache (see ecide_cache.c), allocated
+ * at boot.  -1 picks a size from the amount of memory: none for machines
+ * with less than ECIDE_CACHE_MINMEM, as the memory's better used elsewhere.
+ */
+#define ECIDE_CACHE_MINMEM      (8*1024*1024)
+#define ECIDE_CACHE_AUTO_KB     256
+
+int ecide_cache_kb = -1;
+
+/*
+ * ecide_write_behind: if set (and there's a cache), asynchronous writes
+ * are done as soon as they're in the cache, and written back to the disc
+ * later, gathered into sorted runs of consecutive sectors.  That's
+ * ECIDE_WB_DELAY after the first, or sooner if half the cache is dirty,
+ * and on the last close of the drive and at shutdown.  Synchronous writes
+ * still go straight to the disc, as the filesystem relies on their order.
+ * A crash loses what's not been written back.
+ */
+#define ECIDE_WB_DELAY          (2*hz)
+
+int ecide_write_behind = 0;
+
+/*
+ * ecide_features: drive features to turn on at boot where the drive has
+ * them (IDE_F_WCACHE, IDE_F_LOOKAHEAD); those not set are turned off.
+ * With the write cache on, the drive is told to write it back (FLUSH
+ * CACHE) on last close, for ECIDEIOCSYNC, and at shutdown.
+ */
+int ecide_features = IDE_F_WCACHE | IDE_F_LOOKAHEAD;
+
+/* Most sectors read ahead (see ide_ra_want()), or written back, per command */
+#define ECIDE_STAGE_MAX         64
+
 /*
  * Memory scavenging support.  If no expansion card for this device is
  * found at system boot time, then the XCB manager will attempt to
@@ -162,6 +226,7 @@ static ide_host_t       ide_card[MAX_CARD];
  * memory allocation routine
  */
 extern caddr_t permalloc();
+extern int physmem;
 
 /* Scratch buffer for the various identification/partition probing */
 static u8 *sector_scratch;
@@ -214,7 +279,286 @@ static void release_raw_buf (struct buf *bp)
 
 /* Expansion Card Bus manager interface code */
 
-static void ecide_init_high(int slot, regs_t regs, regs_t hi_latch_write, regs_t hi_latch_read, host_type_t host_type)
+/*
+ * Properties of each type of card, indexed by host_type_t.
+ *
+ * pio_max caps the PIO mode negotiated with drives: the card's bus timing
+ * (and whether IORDY is wired through, needed for modes 3/4) limits what
+ * works.
+ *
+ * irq_mask is the card's op to (un)mask its interrupt, zero if it can't
+ * interrupt.
+ *
+ * data_window is the podule-space offset of a 32-byte region that might
+ * all decode to the data register, which is probed at init and, if it
+ * works, used for LDM/STM burst transfers.  Zero if the card has none (or
+ * none is known).  None is filled in yet: which of these cards alias the
+ * data register like that hasn't been checked on hardware, and the probe's
+ * own accesses to a wrong guess could land on the command register.
+ *
+ * ctl_offset is the offset from the registers of the control block
+ * (device control/alternate status), which lets ide_init() soft-reset
+ * the drives.  Zero if the card doesn't decode it.
+ */
+static void castle_irq_mask(ide_host_t *ih, int enable);
+
+static const struct {
+        unsigned int    pio_max;
+        void            (*irq_mask)(ide_host_t *ih, int enable);
+        unsigned int    data_window;
+        unsigned int    ctl_offset;
+} host_info[] = {
+        { 4, 0, 0, 0 },                 /* HOST_ZIDEFS */
+        { 4, castle_irq_mask, 0, 0 },   /* HOST_CASTLE */
+        { 2, 0, 0, 0x40 },              /* HOST_HCCS (8-bit, latched) */
+};
+
+/* Reading status deasserts INTRQ */
+static void ecide_irq_ack(ide_host_t *ih)
+{
+        (void)read_reg8(ih->regs, wd_status);
+}
+
+/*
+ * ide_io's hook for long waits (e.g. seeks): if the card's current work is
+ * for a process, sleep for a clock tick so others can run.  Never while
+ * panicking, when the system may not be able to switch process.
+ *
+ * The clock's held off from setting the timeout until we're asleep, else
+ * it could go off first and the wakeup be lost.  The time slept is taken
+ * from the system time, as other processes may run for longer than the
+ * tick asked for.
+ */
+static void ecide_yield_wake(caddr_t arg)
+{
+        wakeup(arg);
+}
+
+int ide_yield(ide_host_t *ih)
+{
+        struct timeval t0;
+        int s, us;
+
+        if (!ih->can_yield || panicstr)
+                return 0;
+        s = splhigh();
+        t0 = time;
+        timeout(ecide_yield_wake, (caddr_t)&ih->can_yield, 1);
+        sleep((caddr_t)&ih->can_yield, PRIBIO);
+        us = (time.tv_sec - t0.tv_sec)*1000000 + (time.tv_usec - t0.tv_usec);
+        splx(s);
+        return us > 1000000/hz ? us : 1000000/hz;
+}
+
+/*
+ * ide_io's clock, for timing its polling loops (see ide_calibrate()).
+ * IOC timer 0 runs the system clock: it counts down at 2MHz from
+ * 2000000/hz - 1, reloading each tick, so it gives the time into the
+ * current tick.  Writing the latch command register copies the count
+ * to where it can be read.
+ */
+#define IOC_TIMER0              ((regs_t)0x03200040)
+#define IOC_T_LOW               0
+#define IOC_T_HIGH              1
+#define IOC_T_LATCH             3
+#define IOC_TIMER_HZ            2000000
+
+unsigned int ide_timer(unsigned int *period)
+{
+        unsigned int c;
+
+        write_reg8(IOC_TIMER0, IOC_T_LATCH, 0);
+        c = read_reg8(IOC_TIMER0, IOC_T_LOW);
+        c |= read_reg8(IOC_TIMER0, IOC_T_HIGH) << 8;
+        *period = 1000000/hz;
+        return (IOC_TIMER_HZ/hz - 1 - c) / 2;
+}
+
+#ifdef SUPPORT_IRQS
+static void ecide_irq_handler(int card);
+static void ecide_watchdog(caddr_t arg);
+static void start_drive(ide_host_t *ih);
+#endif
+static void ecide_run_polled(ide_host_t *ih, int s);
+static void ecide_dispatch(int s);
+static void ecide_drain(ide_host_t *ih);
+static int ecide_sync(ide_host_t *ih, int drive, int flush, int s);
+static int ecide_erase(ide_host_t *ih, int drive, unsigned int sector,
+                       unsigned int count, int s);
+
+/*
+ * Podule bus speed tuning.
+ *
+ * The entry points below map each card at a conservative XCB cycle speed:
+ * SLOW, or SYNC for Castle.  Once drives have been found,
+ * ecide_tune_speed() reads IDENTIFY at that speed as the reference, then
+ * steps up through the faster speeds, slowest first, keeping the fastest
+ * at which everything still matches.  It stops at the first speed that
+ * fails: one that only works above a failing speed is marginal, so isn't
+ * trusted.  The data register (plus any high-byte latches) is tuned first,
+ * with the control registers left at the entry speed, by reading IDENTIFY
+ * twice and comparing with the reference.  Then the control/status
+ * registers, by write/read-back of the address registers followed by a
+ * whole IDENTIFY with everything at the new speeds.  The two are tuned
+ * separately, as a card's data path might be the one that's
+ * buffered/latched.
+ *
+ * What it buys is reported as ide_calibrate()'s polling rate before and
+ * after: each turn is a status read plus a 1us delay, so the change in
+ * its period is the change in a control register access.
+ *
+ * Each slot's podule space is a 16KB window, the same offset at every
+ * speed.
+ */
+#define N_XCB_SPEEDS    4
+#define XCB_OFFSET(r)   ((unsigned int)(r) & 0x3fff)
+
+/* Slowest first */
+static const char *xcb_speed_name[N_XCB_SPEEDS] = {
+        "sync", "slow", "medium", "fast"
+};
+
+static regs_t   xcb_respeed(regs_t r, int slot, int speed)
+{
+        unsigned int b;
+
+        if (!r)
+                return 0;
+        switch (speed) {
+        case 0:         b = XCB_ADDRESS(SYNC, slot);    break;
+        case 1:         b = XCB_ADDRESS(SLOW, slot);    break;
+        case 2:         b = XCB_ADDRESS(MEDIUM, slot);  break;
+        default:        b = XCB_ADDRESS(FAST, slot);    break;
+        }
+        return (regs_t)(b + XCB_OFFSET(r));
+}
+
+/* The speed r is mapped at, as an index into xcb_speed_name[] */
+static int      xcb_speed_of(regs_t r, int slot)
+{
+        int speed;
+
+        for (speed = N_XCB_SPEEDS - 1; speed > 0; speed--) {
+                if (xcb_respeed(r, slot, speed) == r)
+                        break;
+        }
+        return speed;
+}
+
+static int      ecide_regs_echo(regs_t r)
+{
+        static const u8 pat[] = { 0xaa, 0x55, 0xff, 0x00, 0xa5, 0x5a };
+        unsigned int i;
+
+        for (i = 0; i < sizeof(pat); i++) {
+                u8 v = pat[i];
+                u8 w = pat[(i + 1) % sizeof(pat)];
+                u8 u = pat[(i + 2) % sizeof(pat)];
+
+                write_reg8(r, wd_cyl_lo, v);
+                write_reg8(r, wd_cyl_hi, w);
+                write_reg8(r, wd_seccnt, u);
+                if (read_reg8(r, wd_cyl_lo) != v ||
+                    read_reg8(r, wd_cyl_hi) != w ||
+                    read_reg8(r, wd_seccnt) != u)
+                        return 0;
+        }
+        return 1;
+}
+
+static void     ecide_tune_speed(ide_host_t *ih)
+{
+        regs_t o_regs = ih->regs;
+        regs_t o_data = ih->data_regs;
+        regs_t o_lw = ih->hi_latch_write;
+        regs_t o_lr = ih->hi_latch_read;
+        unsigned int o_loops = ih->loops_ms;
+        unsigned int ref;
+        int drive, ds, cs, sp;
+
+        drive = ih->drives[0].present ? 0 : 1;
+        ref = ide_identify_sum(ih, drive, sector_scratch);
+        if (!ref)
+                return;
+
+        /* Data register first, with control regs at the entry speed.
+         * Two reads at each speed, to catch marginal timing:
+         */
+        ds = xcb_speed_of(o_data, ih->slot);
+        for (sp = ds + 1; sp < N_XCB_SPEEDS; sp++) {
+                ih->data_regs = xcb_respeed(o_data, ih->slot, sp);
+                ih->hi_latch_write = xcb_respeed(o_lw, ih->slot, sp);
+                ih->hi_latch_read = xcb_respeed(o_lr, ih->slot, sp);
+                if (ide_identify_sum(ih, drive, sector_scratch) != ref ||
+                    ide_identify_sum(ih, drive, sector_scratch) != ref)
+                        break;
+                ds = sp;
+        }
+        ih->data_regs = xcb_respeed(o_data, ih->slot, ds);
+        ih->hi_latch_write = xcb_respeed(o_lw, ih->slot, ds);
+        ih->hi_latch_read = xcb_respeed(o_lr, ih->slot, ds);
+
+        cs = xcb_speed_of(o_regs, ih->slot);
+        for (sp = cs + 1; sp < N_XCB_SPEEDS; sp++) {
+                ih->regs = xcb_respeed(o_regs, ih->slot, sp);
+                /* A whole command with everything at new speeds: */
+                if (!ecide_regs_echo(ih->regs) ||
+                    ide_identify_sum(ih, drive, sector_scratch) != ref)
+                        break;
+                cs = sp;
+        }
+        ih->regs = xcb_respeed(o_regs, ih->slot, cs);
+
+        /* The echo tests scribbled on the taskfile */
+        ide_tf_invalidate(ih);
+        /* Waits poll faster now */
+        ide_calibrate(ih);
+
+        printf("ecide%d: bus speed %s (data), %s (control), %d polls/ms (was %d)\n",
+               ih->card_num, xcb_speed_name[ds], xcb_speed_name[cs],
+               ih->loops_ms, o_loops);
+}
+
+/* Probe the card's data window (if it has one), at the data reg's speed */
+static void     ecide_probe_window(ide_host_t *ih)
+{
+        unsigned int off = host_info[ih->type].data_window;
+        regs_t w;
+        int r;
+
+        if (!off)
+                return;
+        w = (regs_t)(((unsigned int)ih->data_regs & ~0x3fff) + off);
+        r = ide_probe_window(ih, ih->drives[0].present ? 0 : 1, w, sector_scratch);
+        if (r)
+                printf("ecide%d: burst transfers (%s)\n", ih->card_num,
+                       r == 3 ? "read/write" : "read only");
+}
+
+/* Set up the sector cache, once there's a drive for it to cache */
+static unsigned int ecide_cache_lines;
+
+static void     ecide_cache_setup(void)
+{
+        static int done = 0;
+        unsigned int bytes, n;
+        int kb = ecide_cache_kb;
+
+        if (done)
+                return;
+        done = 1;
+        if (kb < 0)
+                kb = ctob(physmem) >= ECIDE_CACHE_MINMEM ? ECIDE_CACHE_AUTO_KB : 0;
+        if (kb == 0)
+                return;
+        bytes = ide_cache_size(kb * 1024 / ide_cache_size(1));
+        n = ide_cache_init((u8 *)permalloc(bytes), bytes);
+        printf("ecide: %dKB sector cache\n", n * IDE_CACHE_LINE * D_SECSIZE / 1024);
+        ecide_cache_lines = n;
+}
+
+static void ecide_init_high(int slot, regs_t regs, regs_t hi_latch_write, regs_t hi_latch_read,
+                            regs_t irq_ctl, host_type_t host_type)
 {
         int card;
         int i;
@@ -238,9 +582,40 @@ static void ecide_init_high(int slot, regs_t regs, regs_t hi_latch_write, regs_t
         ih->slot = slot;
         ih->card_num = card;
         ih->regs = regs;
+        ih->data_regs = regs;
         ih->hi_latch_write = hi_latch_write;
         ih->hi_latch_read = hi_latch_read;
+        ih->rd_window = 0;
+        ih->wr_window = 0;
+        ih->ctl_regs = host_info[host_type].ctl_offset ?
+                regs + host_info[host_type].ctl_offset : 0;
+        ide_set_data_ops(ih);
+        ih->ops.setup_address = ide_setup_address;
+        if (irq_ctl) {
+                ih->ops.irq_mask = host_info[host_type].irq_mask;
+                ih->ops.irq_ack = ecide_irq_ack;
+        } else {
+                ih->ops.irq_mask = 0;
+                ih->ops.irq_ack = 0;
+        }
         ih->type = host_type;
+        ih->pio_max = host_info[host_type].pio_max;
+        ih->features = ecide_features;
+        ih->irq_ctl = irq_ctl;
+        ih->use_irqs = 0;
+        ih->can_yield = 0;
+        ih->xfer_active = 0;
+        ih->d_ioq.dq_actf = ih->d_ioq.dq_actl = NULL;
+        ih->d_ioq.dq_qcnt = 0;
+        for (i = 0; i < 2; i++) {
+                ih->d_drvq[i] = NULL;
+                ih->d_headpos[i] = 0;
+                ih->d_openmask[i] = 0;
+        }
+        ih->d_busy = 0;
+        ih->d_want = 0;
+        ih->d_recover = 0;
+        ih->d_lastdrive = 0;
 
         sector_scratch = (u8 *)permalloc(512);
 
@@ -254,11 +629,25 @@ static void ecide_init_high(int slot, regs_t regs, regs_t hi_latch_write, regs_t
                 return;
         }
 
-        /* When the time comes for interrupts, register them as follows: */
-#ifdef SUPPORT_IRQS /* Not defined! */
-        ih->d_ih.ih_fn = ecide_irq_handler;
-        ih->d_ih.ih_farg = foo_argument;
-        decl_xcb_interrupt(slot, &ih->d_ih, PRIO_BIO); /* Normal BIO priority */
+        ecide_tune_speed(ih);
+        ecide_probe_window(ih);
+        ecide_cache_setup();
+        ih->d_stage = 0;
+        ih->d_wb = 0;
+        ih->d_wb_flush = 0;
+        ih->d_wb_turn = 0;
+        if (ecide_cache_lines)
+                ih->d_stage = (u8 *)permalloc(ECIDE_STAGE_MAX * D_SECSIZE);
+
+        /* Register the handler now, but the card's IRQ stays masked until
+         * ecide_init_low() has finished its polled partition probing.
+         */
+#ifdef SUPPORT_IRQS
+        if (ih->ops.irq_mask) {
+                ih->d_ih.ih_fn = ecide_irq_handler;
+                ih->d_ih.ih_farg = card;
+                decl_xcb_interrupt(slot, &ih->d_ih, PRIO_BIO); /* Normal BIO priority */
+        }
 #endif
 
         /*
@@ -318,25 +707,33 @@ static int      ecide_z_probe_width(int slot)
 void ecide_init_zidefs(int slot)
 {
         int width = ecide_z_probe_width(slot);
-        regs_t podule_regs = (regs_t)XCB_ADDRESS(FAST, slot);
+        regs_t podule_regs = (regs_t)XCB_ADDRESS(SLOW, slot);       /* See ecide_tune_speed() */
 
         if (width == 16)
-                ecide_init_high(slot, podule_regs + 0x3000, 0, 0, HOST_ZIDEFS);
+                ecide_init_high(slot, podule_regs + 0x3000, 0, 0, 0, HOST_ZIDEFS);
         else if (width == 8)
                 ecide_init_high(slot, podule_regs + 0x2400, podule_regs + 0x2800,
-                                podule_regs + 0x2800, HOST_ZIDEFS);
+                                podule_regs + 0x2800, 0, HOST_ZIDEFS);
 }
 
 /* Probe entrypoint for Castle IDE podule:
- * No IRQs yet (though TBC, hardware supports IRQs), ADFS partition.
+ * IRQs (masked by a latch at 0x3000), ADFS partition.
  */
+#define CASTLE_IRQ_ENABLE       0x01
+
+static void castle_irq_mask(ide_host_t *ih, int enable)
+{
+        write_reg8(ih->irq_ctl, 0, enable ? CASTLE_IRQ_ENABLE : 0x00);
+}
+
 void ecide_init_castle(int slot)
 {
         regs_t ide_regs = (regs_t)(XCB_ADDRESS(SYNC, slot) + 0x1000);
+        regs_t irq_ctl = (regs_t)(XCB_ADDRESS(SYNC, slot) + 0x3000);
 
-        write_reg8(XCB_ADDRESS(SYNC, slot) + 0x3000, 0, 0x00);  /* Disable IRQ (for now */
+        write_reg8(irq_ctl, 0, 0x00);   /* Disable IRQ until init_low is done */
 
-        ecide_init_high(slot, ide_regs, 0, 0, HOST_CASTLE);
+        ecide_init_high(slot, ide_regs, 0, 0, irq_ctl, HOST_CASTLE);
 }
 
 /* Probe entrypoint for HCCS A3000 IDE podule:
@@ -352,9 +749,9 @@ void ecide_init_castle(int slot)
  */
 void ecide_init_hccs(int slot)
 {
-        regs_t podule_regs = (regs_t)XCB_ADDRESS(FAST, slot);
+        regs_t podule_regs = (regs_t)XCB_ADDRESS(SLOW, slot);       /* See ecide_tune_speed() */
         ecide_init_high(slot, podule_regs + 0x2100, podule_regs + 0x2200,
-                        podule_regs + 0x2300, HOST_HCCS);
+                        podule_regs + 0x2300, 0, HOST_HCCS);
 }
 
 /* Probe entrypoint for HCCS Ultimate A30x0 IDE podule:
@@ -369,9 +766,9 @@ void ecide_init_hccs(int slot)
  */
 void ecide_init_hccs_ultimate(int slot)
 {
-        regs_t podule_regs = (regs_t)XCB_ADDRESS(FAST, slot);
+        regs_t podule_regs = (regs_t)XCB_ADDRESS(SLOW, slot);       /* See ecide_tune_speed() */
         ecide_init_high(slot, podule_regs + 0x2d00, podule_regs + 0x2e00,
-                        podule_regs + 0x2f00, HOST_HCCS);
+                        podule_regs + 0x2f00, 0, HOST_HCCS);
 }
 
 int ecide_init_low(int slot, int irqs)
@@ -416,6 +813,17 @@ int ecide_init_low(int slot, int irqs)
                         if (ih->drives[i].present)
                                 ide_dump_partitions(ih, i, sector_scratch);
                 }
+#ifdef SUPPORT_IRQS
+                /* Polled probing is done; from now on, strategy queues
+                 * requests for this card and the IRQ handler moves the data.
+                 */
+                if (ih->ops.irq_mask && (ih->drives[0].present || ih->drives[1].present)) {
+                        ih->use_irqs = 1;
+                        ih->ops.irq_ack(ih);            /* Clear stale INTRQ */
+                        ih->ops.irq_mask(ih, 1);
+                        printf("ecide%d: using IRQs\n", ih->card_num);
+                }
+#endif
         }
         return 0;
 }
@@ -430,6 +838,21 @@ int ecide_init_low(int slot, int irqs)
  */
 void ecide_shutdown (int slot)
 {
+        int i, d;
+
+        for (i = 0; i < n_card; i++) {
+                if (ide_card[i].slot != slot)
+                        continue;
+                if (ide_card[i].ops.irq_mask)
+                        ide_card[i].ops.irq_mask(&ide_card[i], 0);
+                /* Write back anything left in the caches */
+                ecide_drain(&ide_card[i]);
+                for (d = 0; d < 2; d++) {
+                        if (ide_card[i].drives[d].present &&
+                            ide_flush_cache(&ide_card[i], d))
+                                printf("ecide%d:%d: flush cache failed\n", i, d);
+                }
+        }
         /* FIXME: We can't do a drive reset on all cards (e.g. ZIDEFS card) */
 }
 
@@ -464,61 +887,1028 @@ int ecide_open(dev_t dev, int flag)
                 return EROFS;
 
         /* all seems to be in order */
+        ih->d_openmask[drive] |= 1 << PARTNO(mindev);
         return 0;
 }
 
 int ecide_close (dev_t dev, int flag)
 {
-        /* We don't need to do anything special here */
-        return 0;
+        int mindev = minor(dev);
+        int drive = DRIVENO(mindev);
+        int card = CARDNO(mindev);
+        ide_host_t *ih;
+        int s, r;
+
+        if (card >= n_card)
+                return 0;
+        ih = &ide_card[card];
+
+        /* Write back the caches; the drive's own only on its last close */
+        s = splbio();
+        ih->d_openmask[drive] &= ~(1 << PARTNO(mindev));
+        r = ecide_sync(ih, drive, ih->d_openmask[drive] == 0, s);
+        splx(s);
+        return r;
 }
 
-static void ecide_do_immediate(ide_host_t *ih, struct buf *bp)
+
+int ecide_ioctl (dev_t dev, int cmd, caddr_t data, int flag)
 {
-        /* Transfer bp->b_bcount/DEV_BSIZE blocks from bp->b_blkno
-         * (within partition given by bp->b_dev) to/from bp->b_un.b_addr
-         */
-        int mindev = minor(bp->b_dev);
+        int mindev = minor(dev);
         int drive = DRIVENO(mindev);
+        int card = CARDNO(mindev);
+        struct ecide_erase *er;
         drive_info_t *di;
         struct part *pt;
-        unsigned int start_sector;
-        unsigned int total_sectors;
-        unsigned char *start_addr;
-        unsigned int s;
-        int r;
+        int s, r;
 
-        di = &ih->drives[drive];
+        if (card >= n_card || !ide_card[card].drives[drive].present)
+                return ENXIO;
+        di = &ide_card[card].drives[drive];
         pt = &di->d_part[PARTNO(mindev)];
-        start_sector = (bp->b_blkno*SECS_PER_BLK) + pt->p_start;
-        total_sectors = (bp->b_bcount / DEV_BSIZE)*SECS_PER_BLK;
-        start_addr = (unsigned char *)bp->b_un.b_addr;
-#ifdef SUPER_VERBOSE
-        DBG("ecide_do_immediate(card %d, min %d, dr %d) start %d, total %d, %s\n",
-            ih->card_num, mindev, drive, start_sector, total_sectors,
-            bp->b_flags & B_READ ? "RD" : "WR");
+
+        switch (cmd) {
+        case ECIDEIOCSYNC:
+                s = splbio();
+                r = ecide_sync(&ide_card[card], drive, 1, s);
+                splx(s);
+                return r;
+        case ECIDEIOCERASE:
+                er = (struct ecide_erase *)data;
+                if (!(di->feat & IDE_F_CFA))
+                        return ENODEV;
+                if (!(flag & FWRITE))
+                        return EBADF;
+                if (pt->p_rdonly)
+                        return EROFS;
+                if (er->start < 0 || er->count <= 0 || er->start > pt->p_size ||
+                    er->count > pt->p_size - er->start)
+                        return EINVAL;
+                s = splbio();
+                r = ecide_erase(&ide_card[card], drive, pt->p_start + er->start,
+                                er->count, s);
+                splx(s);
+                return r;
+        default:
+                return ENOTTY;
+        }
+}
+
+/*
+ * Request queueing.
+ *
+ * Each drive has its own queue, ih->d_drvq[], kept in C-LOOK order: the
+ * requests at or after the start of the drive's last request (ascending),
+ * then those before it (ascending), so the heads sweep one way and then
+ * return.  When both drives have work, they take turns.
+ * ih->d_ioq.dq_actf is the request being transferred, and dq_qcnt counts
+ * everything queued or in progress.
+ *
+ * While a buf is queued, its absolute start sector is kept in b_resid (as
+ * disksort() does with b_cylin); that's set properly on completion.
+ * Called at splbio.
+ */
+#define b_sector        b_resid
+
+static void ecide_enqueue(ide_host_t *ih, struct buf *bp)
+{
+        int drive = DRIVENO(minor(bp->b_dev));
+        struct part *pt = &ih->drives[drive].d_part[PARTNO(minor(bp->b_dev))];
+        unsigned int pos = ih->d_headpos[drive];
+        unsigned int key = (bp->b_blkno*SECS_PER_BLK) + pt->p_start;
+        int wrapped = key < pos;
+        struct buf **pp;
+        struct buf *q;
+
+        bp->b_sector = key;
+        for (pp = &ih->d_drvq[drive]; (q = *pp) != NULL; pp = &q->av_forw) {
+                int qwrapped = (unsigned int)q->b_sector < pos;
+
+                /* bp goes before q if it's in the earlier run, or they're
+                 * in the same run and bp is lower:
+                 */
+                if (wrapped != qwrapped ? !wrapped : key < (unsigned int)q->b_sector)
+                        break;
+        }
+        bp->av_forw = q;
+        *pp = bp;
+        ih->d_ioq.dq_qcnt++;
+}
+
+/* Take the next request to run off the drive queues, or NULL if none */
+static struct buf *ecide_dequeue(ide_host_t *ih)
+{
+        int drive = !ih->d_lastdrive;
+        struct buf *bp;
+
+        if (ih->d_drvq[drive] == NULL)
+                drive = !drive;
+        bp = ih->d_drvq[drive];
+        if (bp == NULL)
+                return NULL;
+        ih->d_drvq[drive] = bp->av_forw;
+        bp->av_forw = NULL;
+        ih->d_headpos[drive] = bp->b_sector;
+        ih->d_lastdrive = drive;
+        return bp;
+}
+
+/*
+ * Extend the read in ih->xfer to read ahead into the cache, if it
+ * continues a sequential stream.  That's staged in ih->d_stage, as an
+ * extra segment, and cached when the transfer completes.  It mustn't read
+ * over a write that's queued but not yet done, as that would cache stale
+ * data.
+ */
+static void ecide_read_ahead(ide_host_t *ih)
+{
+        ide_xfer_t *x = &ih->xfer;
+        drive_info_t *di = &ih->drives[x->drive];
+        unsigned int end = x->sector + x->count;
+        unsigned int max = ECIDE_STAGE_MAX;
+        unsigned int ra;
+        struct buf *q;
+
+        if (max > ecide_cache_lines * IDE_CACHE_LINE / 4)
+                max = ecide_cache_lines * IDE_CACHE_LINE / 4;
+        if (end >= di->total_sectors)
+                return;
+        if (max > di->total_sectors - end)
+                max = di->total_sectors - end;
+        for (q = ih->d_drvq[x->drive]; q != NULL; q = q->av_forw) {
+                if (!(q->b_flags & B_READ) && (unsigned int)q->b_sector >= end &&
+                    (unsigned int)q->b_sector < end + max)
+                        max = q->b_sector - end;
+        }
+        if (max == 0)
+                return;
+
+        ra = ide_ra_want(IDE_CACHE_UNIT(ih->card_num, x->drive), end, max);
+        if (ra == 0)
+                return;
+        x->segs[x->nsegs].addr = ih->d_stage;
+        x->segs[x->nsegs].count = ra;
+        x->nsegs++;
+        x->count += ra;
+        ih->d_ra = ra;
+}
+
+/*
+ * A write is being queued: if the read in progress covers any of the same
+ * sectors, what it reads may be older than what's now in the cache, so
+ * don't cache it.  (A read started later checks the queue instead; see
+ * ecide_write_pending().)  Called at splbio.
+ */
+static void ecide_fill_guard(ide_host_t *ih, int drive, unsigned int sector,
+                             unsigned int n)
+{
+        ide_xfer_t *x = &ih->xfer;
+        unsigned int start, len, i;
+
+        if (!ih->xfer_active || x->write || (int)x->drive != drive ||
+            ih->d_ioq.dq_actf == NULL)
+                return;
+        start = ih->d_ioq.dq_actf->b_sector;
+        for (len = 0, i = 0; i < x->nsegs; i++)
+                len += x->segs[i].count;
+        if (sector < start + len && sector + n > start)
+                ih->d_nofill = 1;
+}
+
+/*
+ * Is a write of any of these sectors queued for the drive?  If so, a read
+ * of them mustn't be cached: a raw write leaves uncached sectors alone,
+ * and lines the write did update may be reused before it's done, so the
+ * read can leave older data in the cache than the disc ends up with.
+ */
+static int ecide_write_pending(ide_host_t *ih, int drive, unsigned int sector,
+                               unsigned int n)
+{
+        struct buf *q;
+        unsigned int len;
+
+        for (q = ih->d_drvq[drive]; q != NULL; q = q->av_forw) {
+                if (q->b_flags & B_READ)
+                        continue;
+                len = (q->b_bcount / DEV_BSIZE)*SECS_PER_BLK;
+                if (sector < (unsigned int)q->b_sector + len &&
+                    sector + n > (unsigned int)q->b_sector)
+                        return 1;
+        }
+        return 0;
+}
+
+/*
+ * Set up ih->xfer to write back a run of dirty sectors from the cache
+ * (see ecide_write_behind), taking the drives in turn.  The run is copied
+ * to ih->d_stage, so the cache can take newer writes meanwhile; there are
+ * no bufs.  Runs are taken from the drive's head position on, but that's
+ * left alone: it's what the drive's queue is sorted against (see
+ * ecide_enqueue()).  When the card's drives are clean, ih->d_wb_flush is
+ * cleared, and anyone waiting for that in ecide_close() is woken.  Returns
+ * 0 if there's nothing to write back.
+ */
+static int ecide_wb_next(ide_host_t *ih)
+{
+        ide_xfer_t *x = &ih->xfer;
+        unsigned int sector, n;
+        int i, drive;
+
+        for (i = 1; i <= 2; i++) {
+                drive = (ih->d_lastdrive + i) & 1;
+                if (!ih->drives[drive].present || !ih->d_stage)
+                        continue;
+                n = ide_cache_flush_run(IDE_CACHE_UNIT(ih->card_num, drive),
+                                        ih->d_headpos[drive], &sector,
+                                        ih->d_stage, ECIDE_STAGE_MAX);
+                if (n == 0)
+                        continue;
+                ih->d_ioq.dq_actf = NULL;
+                ih->d_retries = 0;
+                ih->d_lastdrive = drive;
+                ih->d_ra = 0;
+                ih->d_nofill = 0;
+                ih->d_wb = n;
+                ih->d_wb_sector = sector;
+                x->drive = drive;
+                x->sector = sector;
+                x->write = 1;
+                x->count = n;
+                x->segs[0].addr = ih->d_stage;
+                x->segs[0].count = n;
+                x->nsegs = 1;
+                x->noerase = ide_erased_take(&ih->drives[drive], sector, n);
+                return 1;
+        }
+        ih->d_wb_flush = 0;
+        wakeup((caddr_t)&ih->d_wb_flush);
+        return 0;
+}
+
+/*
+ * Set up ih->xfer for the next queued request, if any.  Requests that
+ * follow on from it (same drive, same direction, next sector) are merged
+ * into the same transfer, each buf being a memory segment; they're usually
+ * next in the drive's queue, as it's sorted.  The bufs are chained from
+ * ih->d_ioq.dq_actf.  While ih->d_wb_flush is set, write-backs take turns
+ * with the queue.  Returns 0 if there's nothing to do, or someone's
+ * waiting for the card in ecide_acquire().
+ */
+static int ecide_next_xfer(ide_host_t *ih)
+{
+        ide_xfer_t *x = &ih->xfer;
+        struct buf *bp, *q;
+        unsigned int n;
+
+        ih->d_wb = 0;
+        if (ih->d_want)
+                return 0;       /* Let ecide_acquire() have the card */
+        if (ih->d_wb_flush && (ih->d_wb_turn || ih->d_ioq.dq_qcnt == 0)) {
+                ih->d_wb_turn = 0;
+                if (ecide_wb_next(ih))
+                        return 1;
+        }
+        ih->d_wb_turn = 1;
+        bp = ecide_dequeue(ih);
+        if (bp == NULL)
+                return 0;
+        ih->d_ioq.dq_actf = bp;
+        ih->d_retries = 0;
+        x->drive = DRIVENO(minor(bp->b_dev));
+        x->sector = bp->b_sector;
+        x->write = !(bp->b_flags & B_READ);
+        x->count = 0;
+        x->nsegs = 0;
+        for (;;) {
+                n = (bp->b_bcount / DEV_BSIZE)*SECS_PER_BLK;
+                x->segs[x->nsegs].addr = (unsigned char *)bp->b_un.b_addr;
+                x->segs[x->nsegs].count = n;
+                x->nsegs++;
+                x->count += n;
+
+                q = ih->d_drvq[x->drive];
+                if (q == NULL || x->nsegs == IDE_MAX_SEGS || n == 0 ||
+                    q->b_bcount == 0 ||
+                    (unsigned int)q->b_sector != x->sector + x->count ||
+                    ((q->b_flags & B_READ) == 0) != (x->write != 0))
+                        break;
+                ih->d_drvq[x->drive] = q->av_forw;
+                bp->av_forw = q;
+                bp = q;
+        }
+        bp->av_forw = NULL;
+
+        x->noerase = x->write &&
+                ide_erased_take(&ih->drives[x->drive], x->sector, x->count);
+        ih->d_ra = 0;
+        ih->d_nofill = 0;
+        if (!x->write && ih->d_stage && x->nsegs < IDE_MAX_SEGS)
+                ecide_read_ahead(ih);
+        if (!x->write && ecide_write_pending(ih, x->drive, x->sector, x->count))
+                ih->d_nofill = 1;
+        return 1;
+}
+
+/*
+ * The transfer in ih->xfer has failed: try again from the sector that
+ * failed, rather than from the top, up to IDE_XFER_RETRIES times (see
+ * ide_xfer_retry()).  Returns the outcome of the last try.
+ *
+ * If the drives need resetting first, that takes seconds, which is too
+ * long to spin for in an interrupt or timeout, so it's left to a process:
+ * ih->d_recover is set, and one waiting in ecide_strategy() is woken to do
+ * it (see ecide_recover()).  The transfer stays active meanwhile, so this
+ * returns IDE_XFER_MORE.  If no process turns up within a watchdog period,
+ * ecide_recover_tick() fails the transfer.  Where the card can't reset the
+ * drives, the transfer fails straight away.  Called at splbio, or by
+ * ecide_poll_step() with the card marked busy.
+ */
+static void ecide_recover_tick(caddr_t arg);
+
+static int ecide_retry(ide_host_t *ih, int r)
+{
+        while (r == IDE_XFER_ERROR && ih->d_retries < IDE_XFER_RETRIES) {
+                if (ide_xfer_wants_reset(&ih->xfer)) {
+                        if (!ih->ctl_regs)
+                                return r;       /* Can't reset: give up */
+                        ih->d_retries++;
+                        ih->d_recover = 1;
+                        wakeup((caddr_t)&ih->d_recover);
+                        untimeout(ecide_recover_tick, (caddr_t)ih);
+                        timeout(ecide_recover_tick, (caddr_t)ih, ECIDE_WDOG_TICKS);
+                        return IDE_XFER_MORE;
+                }
+                ih->d_retries++;
+                DBG("ecide%d: error %04x at sector %d, retrying\n", ih->card_num,
+                    ih->xfer.error, ih->xfer.sector - ih->xfer.pending);
+                r = ide_xfer_retry(ih, &ih->xfer);
+        }
+        return r;
+}
+
+/*
+ * Hand the bufs of the transfer back to the kernel, with the outcome of
+ * ih->xfer.  On an error, the bufs before the failing sector are complete,
+ * the one containing it fails, and any after it haven't been touched so
+ * go back on the queue to be tried on their own.  Called at splbio.
+ *
+ * The card stays marked busy until all the biodone()s are done, so that
+ * anything they queue is started by the caller (rather than recursively).
+ */
+static void ecide_xfer_done(ide_host_t *ih, int r)
+{
+        ide_xfer_t *x = &ih->xfer;
+        struct buf *bp, *next;
+        unsigned int done = 0;          /* Sectors transferred */
+        unsigned int unit = IDE_CACHE_UNIT(ih->card_num, x->drive);
+        unsigned int i, n;
+        int failed = 0;
+
+        for (i = 0; i < x->nsegs; i++)
+                done += x->segs[i].count;
+        done -= x->count + x->pending;  /* A write's last block may not have made it */
+
+        if (r != IDE_XFER_DONE)
+                DBG("ecide%d: transfer error %04x, sector %d\n",
+                    ih->card_num, x->error, x->sector);
+
+        if (ih->d_wb) {
+                /* Nobody to hand an error back to */
+                if (r != IDE_XFER_DONE)
+                        printf("ecide%d: write-back failed, drive %d sectors %d-%d lost\n",
+                               ih->card_num, x->drive, ih->d_wb_sector,
+                               ih->d_wb_sector + ih->d_wb - 1);
+                ide_cache_flush_done(unit, ih->d_wb_sector, ih->d_wb,
+                                     r == IDE_XFER_DONE);
+                ih->d_wb = 0;
+        }
+
+        for (bp = ih->d_ioq.dq_actf; bp != NULL; bp = next) {
+                next = bp->av_forw;
+                n = (bp->b_bcount / DEV_BSIZE)*SECS_PER_BLK;
+                ih->d_ioq.dq_qcnt--;
+                if (r != IDE_XFER_DONE && failed) {
+                        ecide_enqueue(ih, bp);
+                        continue;
+                }
+                if (r != IDE_XFER_DONE && (done < n || (next == NULL && !ih->d_ra))) {
+                        /* This one contains the error (or the error was
+                         * reported after all data had moved).  What the
+                         * disc holds for a failed write isn't known.
+                         */
+                        if (x->write)
+                                ide_cache_invalidate(unit, bp->b_sector, n);
+                        bp->b_flags |= B_ERROR;
+                        bp->b_error = EIO;
+                        bp->b_resid = (n - (done < n ? done : n)) * D_SECSIZE;
+                        failed = 1;
+                } else {
+                        /* The disc may be behind the cache */
+                        if (!x->write)
+                                ide_cache_overlay(unit, bp->b_sector, n,
+                                                  (u8 *)bp->b_un.b_addr);
+                        /* Raw reads are usually big and used once, so
+                         * would just push out everything else.
+                         */
+                        if (!x->write && !(bp->b_flags & B_PHYS) && !ih->d_nofill)
+                                ide_cache_fill(unit, bp->b_sector, n,
+                                               (u8 *)bp->b_un.b_addr);
+                        bp->b_resid = 0;
+                        done -= n;
+                }
+                biodone(bp);
+        }
+        /* The read-ahead, if it all arrived */
+        if (ih->d_ra && r == IDE_XFER_DONE && !ih->d_nofill)
+                ide_cache_fill(unit, x->sector - ih->d_ra, ih->d_ra, ih->d_stage);
+        ih->d_ra = 0;
+        ih->d_ioq.dq_actf = NULL;
+        ih->xfer_active = 0;
+        if (x->write)
+                wakeup((caddr_t)&ih->d_wb_flush);       /* For ecide_sync() */
+        wakeup((caddr_t)&ih->d_recover);                /* For ecide_await() */
+        if (ih->d_want)
+                wakeup((caddr_t)&ih->d_want);
+}
+
+/* Release the card's busy mark, handing over to ecide_acquire() */
+static void ecide_unbusy(ide_host_t *ih)
+{
+        ih->d_busy = 0;
+        if (ih->d_recover)
+                wakeup((caddr_t)&ih->d_recover);
+        if (ih->d_want)
+                wakeup((caddr_t)&ih->d_want);
+}
+
+/*
+ * Polled cards have no IRQ to race with, so once a card's marked busy
+ * (ih->d_busy), nothing else touches it or ih->xfer.  The PIO can then be
+ * done at the caller's spl, s, rather than holding off other interrupts at
+ * splbio.  Only the queue is shared, so that's only handled at splbio.
+ *
+ * Synchronously: run everything queued, in order.  If a biodone() or
+ * another process leads to more requests, they're queued and picked up by
+ * the loop already running.  Called, and returns, at splbio.
+ */
+static void ecide_run_polled(ide_host_t *ih, int s)
+{
+        int r;
+
+        if (ih->d_busy || ih->xfer_active)
+                return;         /* Background polling will get to it */
+        ih->d_busy = 1;
+        /* Strategy is only called by processes, so long waits can sleep
+         * (see ide_yield()).  Others' requests queue up meanwhile.
+         */
+        ih->can_yield = 1;
+        while (ecide_next_xfer(ih)) {
+                ih->xfer_active = 1;
+                splx(s);
+                r = ide_xfer_polled(ih, &ih->xfer);
+                (void)splbio();
+                ecide_xfer_done(ih, r);
+        }
+        ih->can_yield = 0;
+        ecide_unbusy(ih);
+}
+
+/*
+ * In the background, with the dispatcher below: one step for a polled
+ * card.  That's starting its next transfer if it's idle, or moving a DRQ
+ * block once its drive is ready, spinning for no longer than the drive
+ * usually takes (see ide_xfer_ready()), so a transfer isn't held to a
+ * block a tick by the drive's short BSY between blocks.  Returns the
+ * sectors moved (at least 1 if anything was done), or 0 if the card's idle
+ * or its drive is still busy.  Called at splbio, with the card marked
+ * busy; the PIO is done at s.
+ */
+static int ecide_poll_step(ide_host_t *ih, int s)
+{
+        ide_xfer_t *x = &ih->xfer;
+        unsigned int left;
+        int moved;
+        int r;
+
+        if (ih->d_recover)
+                return 0;               /* Waiting for ecide_recover() */
+        if (!ih->xfer_active) {
+                if (!ecide_next_xfer(ih))
+                        return 0;
+                ih->xfer_active = 1;
+                left = x->count;
+                splx(s);
+                r = ide_xfer_start(ih, x);
+        } else {
+                splx(s);
+                if (!ide_xfer_ready(ih, x)) {
+                        (void)splbio();
+                        return 0;
+                }
+                left = x->count;
+                r = ide_xfer_service(ih, x);
+        }
+        r = ecide_retry(ih, r);
+        (void)splbio();
+        ih->d_poll_idle = 0;
+        moved = left > x->count ? left - x->count : 1;
+        if (r != IDE_XFER_MORE)
+                ecide_xfer_done(ih, r);
+        return moved;
+}
+
+/*
+ * The dispatcher.  Each card is a separate ATA bus, so a command can be
+ * under way on every card at once: one card's drive seeking while
+ * another's moves data.  So first, every idle card is given its next
+ * command (IRQ-driven cards via start_drive()).  Then the polled cards
+ * are serviced round-robin, each moving a DRQ block whenever its drive's
+ * ready, until each has had ecide_pio_slice sectors or all are waiting on
+ * their drives.  A card finishing a transfer starts its next one straight
+ * away.  While polled cards have work left, ecide_poll_tick() runs this
+ * again on the next clock tick.
+ *
+ * A polled transfer that makes no progress for ECIDE_POLL_STALL() ticks is
+ * failed.  Called, and returns, at splbio; the PIO is done at s.
+ *
+ * Starting a transfer doesn't return until the drive's taken the command,
+ * which may mean waiting (see ecide_kick()); from ecide_poll_tick() that
+ * holds up softclock, but not interrupts.
+ */
+#define ECIDE_POLL_STALL(ih)    (ECIDE_WDOG_TICKS*ECIDE_WDOG_STALLS(ih))
+
+static int ecide_dispatching;
+static int ecide_poll_on;               /* ecide_poll_tick() pending */
+
+static void ecide_poll_tick(caddr_t arg);
+
+static void ecide_dispatch(int s)
+{
+        int quota[MAX_CARD];
+        unsigned int mine = 0;          /* Cards marked busy here */
+        ide_host_t *ih;
+        int c, moved, any;
+
+#ifdef SUPPORT_IRQS
+        for (c = 0; c < n_card; c++) {
+                if (ide_card[c].use_irqs)
+                        start_drive(&ide_card[c]);      /* Nothing if already busy */
+        }
+#endif
+        if (ecide_dispatching)
+                return;         /* Called from a biodone() below */
+        ecide_dispatching = 1;
+
+        for (c = 0; c < n_card; c++) {
+                ih = &ide_card[c];
+                quota[c] = 0;
+                if (!ih->use_irqs && !ih->d_busy) {     /* Else ecide_run_polled() has it */
+                        ih->d_busy = 1;
+                        mine |= 1 << c;
+                        quota[c] = ecide_pio_slice;
+                        if (!ih->xfer_active)
+                                quota[c] -= ecide_poll_step(ih, s);
+                }
+        }
+
+        do {
+                any = 0;
+                for (c = 0; c < n_card; c++) {
+                        if (quota[c] <= 0)
+                                continue;
+                        moved = ecide_poll_step(&ide_card[c], s);
+                        quota[c] -= moved;
+                        any |= moved;
+                }
+        } while (any);
+
+        any = 0;
+        for (c = 0; c < n_card; c++) {
+                ih = &ide_card[c];
+                if (mine & (1 << c))
+                        ecide_unbusy(ih);
+                if (!ih->use_irqs && (ih->d_ioq.dq_qcnt > 0 || ih->d_wb_flush))
+                        any = 1;
+        }
+        ecide_dispatching = 0;
+
+        if (any && !ecide_poll_on) {
+                ecide_poll_on = 1;
+                timeout(ecide_poll_tick, (caddr_t)0, 1);
+        }
+}
+
+static void ecide_poll_tick(caddr_t arg)
+{
+        ide_host_t *ih;
+        int s = splbio();
+        int c;
+
+        ecide_poll_on = 0;
+        for (c = 0; c < n_card; c++) {
+                ih = &ide_card[c];
+                if (ih->use_irqs || ih->d_busy || !ih->xfer_active || ih->d_recover ||
+                    ++ih->d_poll_idle <= ECIDE_POLL_STALL(ih))
+                        continue;
+                printf("ecide%d: transfer timed out\n", ih->card_num);
+                ih->xfer.error = -1;
+                ide_tf_invalidate(ih);
+                ih->d_busy = 1;
+                ih->d_poll_idle = 0;
+                if (ecide_retry(ih, IDE_XFER_ERROR) != IDE_XFER_MORE)
+                        ecide_xfer_done(ih, IDE_XFER_ERROR);
+                ecide_unbusy(ih);
+        }
+        ecide_dispatch(s);
+        splx(s);
+}
+
+/*
+ * A request has been queued on ih by ecide_strategy(): get it going, without
+ * doing the bulk of the PIO for the caller, who may just be reading ahead
+ * (breada()) or writing asynchronously.  If the card's idle, its command
+ * is issued here: that can wait up to IDE_TMO_SHORT for the drive to take
+ * it and, for a write, IDE_TMO_LONG for it to ask for the first block
+ * (ide_xfer_command()), though a working drive takes microseconds.  An
+ * IRQ-driven card carries on from its interrupts; the rest of a polled
+ * card's transfer is left to ecide_poll_tick(), by when a read's drive
+ * will usually have the data.  Called at splbio; the PIO is done at s.
+ */
+static void ecide_kick(ide_host_t *ih, int s)
+{
+#ifdef SUPPORT_IRQS
+        if (ih->use_irqs) {
+                start_drive(ih);
+                return;
+        }
 #endif
-        r = 0;
-        s = 0;
-        if (bp->b_flags & B_READ) {
-                r = ide_read_some(ih, drive, start_sector, total_sectors, start_addr);
-                if (r)
-                        goto err;
+        if (!ih->d_busy && !ih->xfer_active && !ecide_dispatching) {
+                ih->d_busy = 1;
+                (void)ecide_poll_step(ih, s);
+                ecide_unbusy(ih);
+        }
+        if (!ecide_poll_on) {
+                ecide_poll_on = 1;
+                timeout(ecide_poll_tick, (caddr_t)0, 1);
+        }
+}
+
+/*
+ * Reset the drives and retry the card's transfer, for ecide_retry(), from
+ * a process: the reset and setting the drives up again are done at s,
+ * sleeping in the waits, with the card marked busy so that
+ * ecide_dispatch() leaves it alone; its IRQ handler ignores it while
+ * ih->d_recover is set.  If the drives don't come back, the transfer
+ * fails.  Called, and returns, at splbio.
+ */
+static void ecide_recover(ide_host_t *ih, int s)
+{
+        int r;
+
+        untimeout(ecide_recover_tick, (caddr_t)ih);
+        ih->d_busy = 1;
+        ih->can_yield = 1;
+        splx(s);
+        r = ide_recover(ih);
+        (void)splbio();
+        ih->can_yield = 0;
+        ih->d_recover = 0;
+        if (r != 0) {
+                printf("ecide%d: drives didn't recover from reset\n", ih->card_num);
+                r = IDE_XFER_ERROR;
         } else {
-                r = ide_write_some(ih, drive, start_sector, total_sectors, start_addr);
-                if (r)
-                        goto err;
+                r = ecide_retry(ih, ide_xfer_retry(ih, &ih->xfer));
         }
+        if (r != IDE_XFER_MORE)
+                ecide_xfer_done(ih, r);
+        ecide_unbusy(ih);
+        ecide_dispatch(s);              /* Carry on, or start the next */
+}
 
-        return;
-err:
-        DBG("ecide_do_immediate(card %d, min %d, dr %d) Transfer error %04x, sector %d\n",
-            ih->card_num, mindev, drive, r, s);
-        bp->b_flags |= B_ERROR;
-        bp->b_error = EIO;
-        bp->b_resid = bp->b_bcount - ((s - start_sector)*D_SECSIZE);
+/*
+ * No process has come to reset the drives (see ecide_retry()): rather
+ * than spin in softclock for the seconds that takes, fail the transfer.
+ */
+static void ecide_recover_tick(caddr_t arg)
+{
+        ide_host_t *ih = (ide_host_t *)arg;
+        int s = splbio();
+
+        if (!ih->d_recover || !ih->xfer_active) {
+                ih->d_recover = 0;              /* ecide_drain() did it */
+                splx(s);
+                return;
+        }
+        if (ih->d_busy) {
+                /* A process is doing it, or the dispatcher's polling */
+                timeout(ecide_recover_tick, arg, 1);
+                splx(s);
+                return;
+        }
+        printf("ecide%d: transfer failed, drives not reset\n", ih->card_num);
+        ih->d_recover = 0;
+        ih->d_busy = 1;
+        ecide_xfer_done(ih, IDE_XFER_ERROR);
+        ecide_unbusy(ih);
+        ecide_dispatch(s);
+        splx(s);
+}
+
+/*
+ * Wait in ecide_strategy() for a request the caller's going to wait for in
+ * biowait() anyway, so that if the drives need resetting meanwhile there's
+ * a process to do it.  Called, and returns, at splbio.
+ */
+static void ecide_await(ide_host_t *ih, struct buf *bp, int s)
+{
+        while (!(bp->b_flags & B_DONE)) {
+                if (ih->d_recover && !ih->d_busy)
+                        ecide_recover(ih, s);
+                else
+                        sleep((caddr_t)&ih->d_recover, PRIBIO);
+        }
+}
+
+/*
+ * Write-behind: ask every card holding dirty sectors to write them back.
+ * Called at splbio.
+ */
+static int ecide_wb_on;                 /* ecide_wb_tick() pending */
+
+static void ecide_wb_mark(void)
+{
+        int c;
+
+        for (c = 0; c < n_card; c++) {
+                if (ide_cache_dirty(IDE_CACHE_UNIT(c, 0)) ||
+                    ide_cache_dirty(IDE_CACHE_UNIT(c, 1)))
+                        ide_card[c].d_wb_flush = 1;
+        }
+}
+
+static void ecide_wb_tick(caddr_t arg)
+{
+        int s = splbio();
+
+        ecide_wb_on = 0;
+        ecide_wb_mark();
+        ecide_dispatch(s);
+        splx(s);
 }
 
+/*
+ * Writes have just been left in the cache: start writing back now if
+ * half the cache is dirty, else make sure it happens in ECIDE_WB_DELAY.
+ * Called at splbio, from ecide_strategy(), so the write-back itself is
+ * left to ecide_kick().
+ */
+static void ecide_wb_note(int s)
+{
+        unsigned int total;
+        int c;
+
+        if (ide_cache_dirty_lines(&total) > total/2) {
+                ecide_wb_mark();
+                for (c = 0; c < n_card; c++)
+                        ecide_kick(&ide_card[c], s);
+        } else if (!ecide_wb_on) {
+                ecide_wb_on = 1;
+                timeout(ecide_wb_tick, (caddr_t)0, ECIDE_WB_DELAY);
+        }
+}
+
+/*
+ * Finish the card's transfer in progress, and then everything queued or
+ * to be written back, polled, without sleeping.  For shutdown, when the
+ * clock and IRQs may be gone.
+ */
+static void ecide_drain(ide_host_t *ih)
+{
+        int s = splbio();
+        int r;
+
+        if (ih->xfer_active) {
+                r = IDE_XFER_MORE;
+                if (ih->d_recover) {
+                        ih->d_recover = 0;
+                        if (ide_recover(ih) == 0) {
+                                r = ide_xfer_retry(ih, &ih->xfer);
+                        } else {
+                                ih->xfer.error = -1;
+                                r = IDE_XFER_ERROR;
+                        }
+                }
+                while (r == IDE_XFER_MORE) {
+                        if (ide_wait_nbsy(ih, ide_xfer_tmo(&ih->xfer))) {
+                                ih->xfer.error = -1;
+                                ide_tf_invalidate(ih);
+                                r = IDE_XFER_ERROR;
+                        } else {
+                                r = ide_xfer_service(ih, &ih->xfer);
+                        }
+                }
+                ecide_xfer_done(ih, r);
+        }
+        ih->d_busy = 1;
+        ih->d_wb_flush = 1;
+        while (ecide_next_xfer(ih)) {
+                ih->xfer_active = 1;
+                ecide_xfer_done(ih, ide_xfer_polled(ih, &ih->xfer));
+        }
+        ih->d_busy = 0;
+        splx(s);
+}
+
+/*
+ * Take the card for a command of our own (e.g. FLUSH CACHE), from process
+ * context: wait for the transfer in progress, and stop new ones starting,
+ * until ecide_release().  Called at splbio.
+ */
+static void ecide_acquire(ide_host_t *ih)
+{
+        while (ih->d_busy || ih->xfer_active) {
+                ih->d_want = 1;
+                sleep((caddr_t)&ih->d_want, PRIBIO);
+        }
+        ih->d_want = 0;
+        ih->d_busy = 1;
+}
+
+static void ecide_release(ide_host_t *ih, int s)
+{
+        ecide_unbusy(ih);
+        /* Start what's queued up meanwhile */
+        if (ih->use_irqs || ecide_async_poll)
+                ecide_dispatch(s);
+        else
+                ecide_run_polled(ih, s);
+}
+
+/* Non-zero if a write to the drive is queued or under way.  Called at splbio. */
+static int ecide_writes_queued(ide_host_t *ih, int drive)
+{
+        struct buf *q;
+
+        if (ih->xfer_active && ih->xfer.write && (int)ih->xfer.drive == drive)
+                return 1;
+        for (q = ih->d_drvq[drive]; q != NULL; q = q->av_forw) {
+                if (!(q->b_flags & B_READ))
+                        return 1;
+        }
+        return 0;
+}
+
+/*
+ * Write back what the cache holds for the drive (see ecide_write_behind),
+ * and wait for that and any writes queued; then, if flush is set, have the
+ * drive write back its own cache.  Called at splbio, from process context.
+ * Returns 0, or EIO if the flush failed.
+ */
+static int ecide_sync(ide_host_t *ih, int drive, int flush, int s)
+{
+        unsigned int unit = IDE_CACHE_UNIT(ih->card_num, drive);
+        int r;
+
+        while (ide_cache_dirty(unit) || ecide_writes_queued(ih, drive)) {
+                if (ide_cache_dirty(unit))
+                        ih->d_wb_flush = 1;
+                if (ih->use_irqs || ecide_async_poll)
+                        ecide_dispatch(s);
+                else
+                        ecide_run_polled(ih, s);
+                if (ide_cache_dirty(unit) || ecide_writes_queued(ih, drive))
+                        sleep((caddr_t)&ih->d_wb_flush, PRIBIO);
+        }
+        if (!flush || !(ih->drives[drive].feat_on & IDE_F_WCACHE))
+                return 0;
+
+        ecide_acquire(ih);
+        ih->can_yield = 1;
+        splx(s);
+        r = ide_flush_cache(ih, drive);
+        (void)splbio();
+        ih->can_yield = 0;
+        ecide_release(ih, s);
+        if (r) {
+                printf("ecide%d:%d: flush cache failed, %04x\n", ih->card_num, drive, r);
+                return EIO;
+        }
+        return 0;
+}
+
+/*
+ * Erase count sectors from sector on a CFA drive (see ECIDEIOCERASE), so
+ * that later writes there can skip the erase.  Whatever the cache has for
+ * them (apart from writes still to go, which will be written afterwards)
+ * is dropped.  Called at splbio, from process context.  Returns 0, or EIO.
+ */
+static int ecide_erase(ide_host_t *ih, int drive, unsigned int sector,
+                       unsigned int count, int s)
+{
+        int r;
+
+        ecide_acquire(ih);
+        ide_cache_invalidate(IDE_CACHE_UNIT(ih->card_num, drive), sector, count);
+        ih->can_yield = 1;
+        splx(s);
+        r = ide_cfa_erase(ih, drive, sector, count);
+        (void)splbio();
+        ih->can_yield = 0;
+        ecide_release(ih, s);
+        if (r) {
+                printf("ecide%d:%d: erase failed, %04x\n", ih->card_num, drive, r);
+                return EIO;
+        }
+        return 0;
+}
+
+#ifdef SUPPORT_IRQS
+/*
+ * Start the next queued transfer, if any, unless the card's idle or taken
+ * by ecide_acquire().  Called at splbio.  Transfers that fail to even
+ * start are completed here.
+ */
+static void start_drive(ide_host_t *ih)
+{
+        ide_xfer_t *x = &ih->xfer;
+        int r;
+
+        while (!ih->xfer_active && !ih->d_busy && ecide_next_xfer(ih)) {
+                ih->xfer_active = 1;
+                r = ecide_retry(ih, ide_xfer_start(ih, x));
+                if (r == IDE_XFER_MORE) {
+                        if (!ih->d_wdog_on) {
+                                ih->d_wdog_on = 1;
+                                ih->d_wdog_stalls = 0;
+                                ih->d_wdog_last = ih->d_irqcount;
+                                timeout(ecide_watchdog, (caddr_t)ih, ECIDE_WDOG_TICKS);
+                        }
+                        return;
+                }
+                /* Done already (empty), or failed to start: */
+                ecide_xfer_done(ih, r);
+        }
+}
+
+static void ecide_irq_handler(int card)
+{
+        ide_host_t *ih = &ide_card[card];
+        int r;
+
+        ih->d_irqcount++;
+        if (!ih->xfer_active || ih->d_recover) {
+                /* Spurious, late, or from the reset */
+                ih->ops.irq_ack(ih);
+                return;
+        }
+        r = ecide_retry(ih, ide_xfer_service(ih, &ih->xfer));
+        if (r != IDE_XFER_MORE) {
+                ecide_xfer_done(ih, r);
+                start_drive(ih);
+        }
+}
+
+/*
+ * Periodic check for a transfer that has stopped making progress, e.g.
+ * because an IRQ was lost.  Give the transfer a poke, and if that doesn't
+ * help for a few periods, fail it.
+ */
+static void ecide_watchdog(caddr_t arg)
+{
+        ide_host_t *ih = (ide_host_t *)arg;
+        int s = splbio();
+
+        if (!ih->xfer_active) {
+                ih->d_wdog_on = 0;
+                splx(s);
+                return;
+        }
+        if (ih->d_recover) {
+                ih->d_wdog_stalls = 0;          /* Waiting for ecide_recover() */
+        } else if (ih->d_irqcount != ih->d_wdog_last) {
+                ih->d_wdog_last = ih->d_irqcount;
+                ih->d_wdog_stalls = 0;
+        } else if (++ih->d_wdog_stalls > ECIDE_WDOG_STALLS(ih)) {
+                printf("ecide%d: transfer timed out\n", ih->card_num);
+                ih->xfer.error = -1;
+                ide_tf_invalidate(ih);
+                ih->d_wdog_stalls = 0;
+                if (ecide_retry(ih, IDE_XFER_ERROR) != IDE_XFER_MORE) {
+                        ecide_xfer_done(ih, IDE_XFER_ERROR);
+                        start_drive(ih);
+                }
+        } else if (!(read_reg8(ih->regs, wd_status) & WDCS_BUSY)) {
+                DBG("ecide%d: lost IRQ?\n", ih->card_num);
+                ecide_irq_handler(ih->card_num);
+        }
+        if (ih->xfer_active)
+                timeout(ecide_watchdog, (caddr_t)ih, ECIDE_WDOG_TICKS);
+        else
+                ih->d_wdog_on = 0;
+        splx(s);
+}
+#endif
+
 /*
  * ecide_strategy - where I/O requests are processed.
  */
@@ -531,6 +1921,7 @@ int ecide_strategy(struct buf *bp)
         drive_info_t *di;
         struct part *pt;
         int nblks, s;
+        unsigned int sector, n;
 
         /* Set up for the specific drive and partition involved */
         ih = &ide_card[card];
@@ -547,6 +1938,7 @@ int ecide_strategy(struct buf *bp)
                 bp->b_error = EINVAL;   /* set the error code in */
                 bp->b_resid = bp->b_bcount; /* no data moved */
                 biodone (bp);           /* pass buffer back to kernel control */
+                return 0;
         }
 
         /* work out size of partition in system device block units */
@@ -566,56 +1958,57 @@ int ecide_strategy(struct buf *bp)
                 }
                 bp->b_resid = bp->b_bcount; /* no data moved */
                 biodone (bp);           /* pass buffer back to kernel control */
+                return 0;
         }
 
-
-#ifdef PIO_POLLED
-        s = splbio();
-        ecide_do_immediate(ih, bp);
-        splx(s);
-        biodone(bp);
-#else
-        /* When we support interrupts, the queue becomes useful! */
-
         /*
          * Everything seems OK - now queue and possibly start the transfer.
          *
-         * First we ensure that queue manipulation is not messed up by
-         * interrupts from the controller
+         * First we ensure that queue (and cache) manipulation is not
+         * messed up by interrupts from the controller
          */
+        sector = (bp->b_blkno*SECS_PER_BLK) + pt->p_start;
+        n = (bp->b_bcount / DEV_BSIZE)*SECS_PER_BLK;
         s = splbio();
-
-        ih->d_ioq.dq_qcnt++;         /* one more item in queue now */
-
-        bp->av_forw = NULL;         /* clear forward link, for queuing */
-
-        if (ih->d_ioq.dq_actf == NULL) {
-                /* There was nothing happening: install buffer on empty Q */
-                ih->d_ioq.dq_actf = bp;  /* sits at head of queue */
-                ih->d_ioq.dq_actl = bp;  /* and also at tail */
-                /*
-                 * Start up the operation, since the controller must be
-                 * idle; first set retries on operation to 0.
+        if (!(bp->b_flags & B_READ)) {
+                if (ecide_write_behind && (bp->b_flags & (B_ASYNC|B_PHYS)) == B_ASYNC &&
+                    ide_cache_write_behind(IDE_CACHE_UNIT(card, drive), sector, n,
+                                           (u8 *)bp->b_un.b_addr)) {
+                        ecide_wb_note(s);
+                        splx(s);
+                        bp->b_resid = 0;
+                        biodone(bp);
+                        return 0;
+                }
+                /* Write-through: the cache is updated first (see
+                 * ide_cache_write()).  Raw writes only update what's
+                 * already cached, as for raw reads.
                  */
-                ih->d_retries = 0;
-                start_drive (ih);
+                if (bp->b_flags & B_PHYS)
+                        ide_cache_update(IDE_CACHE_UNIT(card, drive), sector, n,
+                                         (u8 *)bp->b_un.b_addr);
+                else
+                        ide_cache_write(IDE_CACHE_UNIT(card, drive), sector, n,
+                                        (u8 *)bp->b_un.b_addr);
+                ecide_fill_guard(ih, drive, sector, n);
         } else {
-                /*
-                 * There is already at least one entry on the queue, which
-                 * will be being processed at the moment.  For simplicity, we
-                 * just place this request at the end of the current queue
-                 * (first come first served ordering).  It might be useful at
-                 * some stage to attempt some sorting on the queue entries.
-                 * On the other hand, the Berkeley Fast File System does most
-                 * of the work for us, meaning that the extra gain from
-                 * sorting is likely to be small.
-                 */
-                ih->d_ioq.dq_actl->av_forw = bp;
-                bp->av_back = ih->d_ioq.dq_actl;
-                ih->d_ioq.dq_actl = bp;
+                ide_ra_note(IDE_CACHE_UNIT(card, drive), sector, n);
+                if (ide_cache_read(IDE_CACHE_UNIT(card, drive), sector, n,
+                                   (u8 *)bp->b_un.b_addr)) {
+                        splx(s);
+                        bp->b_resid = 0;
+                        biodone(bp);
+                        return 0;
+                }
         }
+        ecide_enqueue(ih, bp);
+        if (ih->use_irqs || ecide_async_poll)
+                ecide_kick(ih, s);
+        else
+                ecide_run_polled(ih, s);
+        if (!(bp->b_flags & B_ASYNC) && !panicstr)
+                ecide_await(ih, bp, s);
         splx (s);                   /* restore SPL */
-#endif
         return 0;
 }
 
@@ -77,6 +77,29 @@ static void __debug_nothing(char *fmt, ...) { }
 #define PARTNO(mindev)  ((mindev) & 7)
 #define MAX_PART        8
 
+/* ioctls: _IO('E', n) etc. */
+#define ECIDEIOCSYNC    (0x20000000 | ('E' << 8) | 1)   /* Write back all caches */
+
+/* CFA drives: erase sectors of the partition that are no longer used
+ * (e.g. freed swap), so later writes there are quicker.
+ */
+struct ecide_erase {
+        int     start;                  /* Sector in partition */
+        int     count;
+};
+#define ECIDEIOCERASE   (0x80000000 | (sizeof(struct ecide_erase) << 16) | ('E' << 8) | 2)
+
+/* Drive features (drive_info_t feat), and the ones to use (ide_host_t
+ * features)
+ */
+#define IDE_F_WCACHE    0x01            /* Write cache */
+#define IDE_F_LOOKAHEAD 0x02            /* Read look-ahead */
+#define IDE_F_CFA       0x04            /* CompactFlash (CFA feature set) */
+
+/* Drive quirks (see ide_quirks[]) */
+#define IDE_Q_NOMULTI   0x01            /* READ/WRITE MULTIPLE can't be trusted */
+#define IDE_Q_NOWCACHE  0x02            /* Write cache can't be trusted: keep it off */
+
 
 /****************************** Types *****************************************/
 
@@ -101,6 +124,13 @@ struct part {
         int p_rdonly;           /* */
 };
 
+#define IDE_ERASED_MAX  8
+
+typedef struct {
+        unsigned int start;
+        unsigned int end;               /* Sector after */
+} ide_extent_t;
+
 typedef struct {
         unsigned int present;
         /* Note limit is 4G*512 = 2TB */
@@ -108,30 +138,138 @@ typedef struct {
         unsigned int cyl;               /* Iff CHS */
         u16 heads;
         u16 sec_per_track;
+        unsigned int spc;               /* Sectors per cylinder (heads * sec_per_track) */
         unsigned char lba_supported;    /* LBA, else CHS */
+        unsigned char lba48;            /* 48-bit LBA (EXT commands) supported */
+        u16 multi_max;                  /* Max sectors per DRQ block (IDENTIFY w47) */
+        u16 multi;                      /* Current block size, or 0 if not multiple mode */
+        unsigned char pio_max;          /* Fastest PIO mode the drive supports */
+        unsigned char pio_mode;         /* PIO mode selected */
+        unsigned char feat;             /* IDE_F_ features the drive has... */
+        unsigned char feat_on;          /* ...and has turned on */
+        unsigned char quirks;           /* IDE_Q_ */
+        unsigned int max_sectors;       /* Per command, or 0 for the default */
+        unsigned int settle_us;         /* Extra delay before each command */
+        unsigned int wait_est;          /* Typical wait for the drive (us), see ide_wait() */
+        unsigned int wait_n;
+
+        /* CFA: extents erased by ide_cfa_erase() and not written since */
+        ide_extent_t erased[IDE_ERASED_MAX];
+        unsigned int nerased;
 
         struct part d_part[MAX_PART];
 } drive_info_t;
 
+/* State of an in-progress transfer, advanced one DRQ block at a time by
+ * ide_xfer_service() (either from the IRQ handler, or by polling).
+ *
+ * The memory side is either one buffer at addr (nsegs = 0), or a list of
+ * segments, e.g. for several bufs merged into one run of sectors.
+ */
+#define IDE_MAX_SEGS    16
+
+typedef struct {
+        unsigned char   *addr;
+        unsigned int    count;          /* Sectors */
+} ide_seg_t;
+
+typedef struct {
+        unsigned int    drive;
+        unsigned int    sector;         /* Next sector to transfer */
+        unsigned int    count;          /* Sectors left to transfer in total */
+        unsigned int    cmd_left;       /* Sectors left in current command */
+        unsigned int    block;          /* Sectors per DRQ block */
+        int             ext;            /* Current command is a 48-bit EXT one */
+        /* CHS of sector (non-LBA drives only), moved along with it: */
+        unsigned int    cyl;
+        unsigned int    head;
+        unsigned int    sect;           /* From 0 */
+        unsigned char   *addr;          /* Memory for next sector */
+        unsigned int    nsegs;
+        unsigned int    seg;            /* Current segment... */
+        unsigned int    seg_left;       /* ...and sectors left in it */
+        ide_seg_t       segs[IDE_MAX_SEGS];
+        int             write;
+        int             noerase;        /* Write is to erased sectors (CFA) */
+        unsigned int    pending;        /* Sectors written but not yet accepted */
+        int             first;          /* No block done since the command */
+        int             error;          /* -1 timeout, else status<<8 | error */
+} ide_xfer_t;
+
 typedef enum {
         HOST_ZIDEFS,
         HOST_CASTLE,
         HOST_HCCS
 } host_type_t;
 
+struct ide_host;
+
+/* Per-host operations, set up by ecide_init_high() for the card type and
+ * its data path (see ide_set_data_ops()).  The transfer path calls through
+ * these rather than testing the host's properties for every block.  The
+ * IRQ ops are zero for cards that can't interrupt.
+ */
 typedef struct {
+        void    (*read_sectors)(struct ide_host *ih, u8 *dest, unsigned int n);
+        void    (*write_sectors)(struct ide_host *ih, u8 *src, unsigned int n);
+        void    (*setup_address)(struct ide_host *ih, ide_xfer_t *x);
+        void    (*irq_mask)(struct ide_host *ih, int enable);
+        void    (*irq_ack)(struct ide_host *ih);
+} ide_ops_t;
+
+typedef struct ide_host {
         int                     slot;
-        regs_t                  regs;
+        regs_t                  regs;             /* Control/status registers */
+        regs_t                  data_regs;        /* Same registers, for data (maybe faster) */
         regs_t                  hi_latch_write;   /* If zero, 16b access is supported */
         regs_t                  hi_latch_read;    /* these two latches may be the same */
+        regs_t                  rd_window;        /* Data reg aliased over 32 bytes, for */
+        regs_t                  wr_window;        /*  LDM/STM bursts; zero if none */
+        regs_t                  ctl_regs;         /* Control block (SRST), or zero if none */
         host_type_t             type;
+        ide_ops_t               ops;
+        unsigned int            pio_max;          /* Fastest PIO mode the card's timing allows */
+        unsigned int            features;         /* IDE_F_ features ide_init() turns on (else off) */
         drive_info_t            drives[2];
         int                     card_num;
+        /* Shadow of the taskfile, indexed by register number, to skip
+         * rewriting registers that already hold the right value.
+         * tf_valid has a bit per register that's known; cur_drive is the
+         * drive last selected, or -1 if unknown.
+         */
+        u8                      tf[8];
+        unsigned int            tf_valid;
+        int                     cur_drive;
+        int                     can_yield;        /* Waits may sleep, see ide_yield() */
+        unsigned int            loops_ms;         /* ide_wait() polls a millisecond, see ide_calibrate() */
+        regs_t                  irq_ctl;          /* Podule IRQ mask, or zero if no IRQs */
+        int                     use_irqs;         /* Non-zero once transfers are IRQ-driven */
+        int                     xfer_active;
+        ide_xfer_t              xfer;
 
 #ifdef _KERNEL
         struct devqueue         d_ioq;      /* I/O operations queue */
+        struct buf              *d_drvq[2];       /* Per-drive C-LOOK queues */
+        unsigned int            d_headpos[2];     /* Start of drive's last request */
+        int                     d_lastdrive;      /* Drive last dispatched */
+        u8                      *d_stage;         /* Read-ahead/write-back staging, or zero */
+        unsigned int            d_ra;             /* Sectors read ahead by this transfer */
+        int                     d_nofill;         /* Don't cache what this transfer reads */
+        unsigned int            d_wb;             /* Sectors this transfer writes back */
+        unsigned int            d_wb_sector;      /*  from here */
+        int                     d_wb_flush;       /* Write back the drives' dirty sectors */
+        int                     d_wb_turn;        /* Write-back goes next */
         struct int_hndlr        d_ih;
         unsigned int            d_retries;
+        unsigned int            d_irqcount;
+        unsigned int            d_wdog_last;      /* d_irqcount at last watchdog tick */
+        int                     d_wdog_stalls;
+        int                     d_wdog_on;
+        int                     d_busy;           /* Owned by ecide_dispatch()/ecide_run_polled()/ecide_acquire() */
+        int                     d_want;           /* Someone's waiting in ecide_acquire() */
+        int                     d_recover;        /* Drives to be reset (see ecide_retry()) */
+        unsigned int            d_openmask[2];    /* Open partitions, per drive */
+        int                     d_poll_idle;      /* Ticks without progress */
 #endif
 } ide_host_t;
 
@@ -146,11 +284,22 @@ typedef struct {
  *
  *      status = read_reg(regs, wd_status);
  */
+#ifdef ECIDE_SIM
+/* Register accesses go to a simulated device (see test/sim_ide.c) */
+unsigned int    sim_read_reg(regs_t base, unsigned int reg, int width);
+void            sim_write_reg(regs_t base, unsigned int reg, unsigned int value, int width);
+
+#define write_reg8(base, reg, value)    sim_write_reg(base, reg, value, 8)
+#define read_reg8(base, reg)            sim_read_reg(base, reg, 8)
+#define write_reg16(base, reg, value)   sim_write_reg(base, reg, value, 16)
+#define read_reg16(base, reg)           sim_read_reg(base, reg, 16)
+#else
 #define REG_ADDR(base, reg)             (volatile unsigned int *)((base)+((reg) << 2))
 #define write_reg8(base, reg, value)    do { *(volatile unsigned char *)REG_ADDR(base, reg) = (value); } while(0)
 #define read_reg8(base, reg)            (*(volatile unsigned char *)REG_ADDR(base, reg))
 #define write_reg16(base, reg, value)   do { *REG_ADDR(base, reg) = (value) << 16; } while(0)
 #define read_reg16(base, reg)           (*REG_ADDR(base, reg) & 0xffff)
+#endif
 
 
 #endif
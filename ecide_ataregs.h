@@ -66,6 +66,7 @@
 #define wd_data         0x0             /* data register (R/W - 16 bits) */
 #define wd_error        0x1             /* error register (R) */
 #define wd_precomp      wd_error        /* write precompensation (W) */
+#define wd_features     wd_error        /* features (W) */
 #define wd_seccnt       0x2             /* sector count (R/W) */
 #define wd_sector       0x3             /* first sector number (R/W) */
 #define wd_lba_lo       wd_sector
@@ -81,6 +82,19 @@
 #define wd_ctlr         0x206           /* fixed disk controller control(via 1015) (W)*/
 #define wd_digin        0x207           /* disk controller input(via 1015) (R)*/
 
+/*
+ * Control block registers, on cards that decode it (see ide_host_t ctl_regs).
+ */
+#define wd_altstatus    0x6             /* status, without acking INTRQ (R) */
+#define wd_devctl       0x6             /* device control (W) */
+
+/*
+ * Device control bits.
+ */
+#define WDCTL_4BIT      0x08            /* use four head bits (wd1003) */
+#define WDCTL_RST       0x04            /* reset the controller */
+#define WDCTL_IDS       0x02            /* disable controller interrupts */
+
 /*
  * Status Bits.
  */
@@ -100,6 +114,37 @@
 #define WDCC_WRITE      0x30            /* disk write code */
 #define WDCC_RESTORE    0x10            /* disk restore code -- resets cntlr */
 #define WDCC_IDENTIFY   0xec            /* Identify device */
+#define WDCC_READ_MULTI 0xc4            /* read, one DRQ per block of sectors */
+#define WDCC_WRITE_MULTI 0xc5           /* write, one DRQ per block of sectors */
+#define WDCC_SET_MULTI  0xc6            /* set block size for the above */
+#define WDCC_READ_EXT   0x24            /* 48-bit LBA versions */
+#define WDCC_READ_MULTI_EXT 0x29
+#define WDCC_WRITE_EXT  0x34
+#define WDCC_WRITE_MULTI_EXT 0x39
+#define WDCC_SET_FEATURES 0xef          /* subcommand in wd_features */
+#define WDCC_READ_BUFFER 0xe4           /* sector buffer, no media access */
+#define WDCC_WRITE_BUFFER 0xe8
+#define WDCC_FLUSH_CACHE 0xe7           /* write back the drive's write cache */
+#define WDCC_FLUSH_CACHE_EXT 0xea
+#define WDCC_CFA_ERASE  0xc0            /* CFA: erase sectors ahead of writing */
+#define WDCC_CFA_WRITE_NE 0x38          /* CFA: write to erased sectors */
+#define WDCC_CFA_WRITE_MULTI_NE 0xcd
+
+/*
+ * SET FEATURES subcommands.
+ */
+#define WDSF_SET_MODE   0x03            /* transfer mode in wd_seccnt */
+#define WDSF_MODE_PIO   0x08            /* | PIO mode number */
+#define WDSF_WCACHE_ON  0x02            /* write cache */
+#define WDSF_WCACHE_OFF 0x82
+#define WDSF_RLA_ON     0xaa            /* read look-ahead */
+#define WDSF_RLA_OFF    0x55
+
+/*
+ * Signatures left in the address registers by a reset.
+ */
+#define WDSIG_ATAPI_MID 0x14            /* packet device, in wd_cyl_lo */
+#define WDSIG_ATAPI_HI  0xeb            /*  and wd_cyl_hi */
 
 #define DRVHD(drive, head)      (0xa0 | ((!!(drive)) << 4) | ((head) & 0xf))
 #define DRVBLK_LBA(drive, blk)  (0xe0 | ((!!(drive)) << 4) | ((blk) & 0xf))
@@ -0,0 +1,570 @@
+/* ecide_cache.c
+ *
+ * Sector cache for the IDE driver
+ *
+ * The kernel's buffer cache is small on these machines (a few hundred KB),
+ * so metadata (inode and cylinder group blocks etc.) is read again and
+ * again.  This keeps recently-used sectors in memory set aside at boot,
+ * in lines of IDE_CACHE_LINE sectors, with a bit per sector saying which
+ * are valid.  Lines are found by hashing the drive and sector, and the
+ * least recently used line is replaced.
+ *
+ * Writes go through to the disc, but update the cache first so it never
+ * holds older data than the disc (see ide_cache_write()).
+ *
+ * Alternatively, writes can be left in the cache as dirty sectors, to be
+ * written back later (ide_cache_write_behind()).  Lines holding dirty
+ * sectors, or sectors being written back, aren't replaced.  The caller
+ * picks them up with ide_cache_flush_run(), in runs of consecutive
+ * sectors, and says how that went with ide_cache_flush_done().  A sector
+ * written again while it's being written back is dirty again, to go in
+ * the next flush.
+ *
+ * The caller provides the locking (e.g. splbio), as this might be called
+ * from both process and interrupt context.
+ *
+ * Copyright (c) 2022 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+#include "ecide.h"
+#include "ecide_cache.h"
+
+#define LINE_BYTES      (IDE_CACHE_LINE * D_SECSIZE)
+
+typedef struct ide_cline {
+        struct ide_cline        *hnext;         /* Hash chain */
+        struct ide_cline        *next;          /* LRU list: towards older... */
+        struct ide_cline        *prev;          /* ...and newer */
+        unsigned int            sector;         /* First sector of line */
+        unsigned int            unit;
+        unsigned int            valid;          /* Bit per sector */
+        unsigned int            dirty;          /* Not yet on the disc */
+        unsigned int            wb;             /* Being written back */
+        u8                      *data;
+} ide_cline_t;
+
+static ide_cline_t      *lines;
+static unsigned int     nlines;
+static ide_cline_t      **hash;
+static unsigned int     hash_mask;
+/* Head of the LRU list: lru.next is the most recently used line, lru.prev
+ * the least.  Lines holding nothing are kept at the old end.
+ */
+static ide_cline_t      lru;
+/* Lines with dirty sectors or sectors being written back, in total and
+ * per unit.
+ */
+static unsigned int     ndirty;
+static unsigned int     unit_dirty[IDE_CACHE_UNITS];
+
+unsigned int ide_cache_hits;
+unsigned int ide_cache_misses;
+
+#define HASH(unit, sector) \
+        ((((sector) / IDE_CACHE_LINE) ^ ((unit) << 7)) & hash_mask)
+
+unsigned int    ide_cache_size(unsigned int n)
+{
+        return n * (LINE_BYTES + sizeof(ide_cline_t) + sizeof(ide_cline_t *));
+}
+
+static void     lru_remove(ide_cline_t *l)
+{
+        l->prev->next = l->next;
+        l->next->prev = l->prev;
+}
+
+/* Insert l after p */
+static void     lru_insert(ide_cline_t *p, ide_cline_t *l)
+{
+        l->next = p->next;
+        l->prev = p;
+        p->next->prev = l;
+        p->next = l;
+}
+
+static ide_cline_t *line_find(unsigned int unit, unsigned int sector)
+{
+        ide_cline_t *l;
+
+        for (l = hash[HASH(unit, sector)]; l; l = l->hnext) {
+                if (l->sector == sector && l->unit == unit)
+                        return l;
+        }
+        return 0;
+}
+
+static void     line_unhash(ide_cline_t *l)
+{
+        ide_cline_t **pp;
+
+        for (pp = &hash[HASH(l->unit, l->sector)]; *pp; pp = &(*pp)->hnext) {
+                if (*pp == l) {
+                        *pp = l->hnext;
+                        return;
+                }
+        }
+}
+
+/* Reuse the least recently used clean line for unit/sector.  Returns 0
+ * if every line is dirty.
+ */
+static ide_cline_t *line_alloc(unsigned int unit, unsigned int sector)
+{
+        ide_cline_t *l;
+        unsigned int h = HASH(unit, sector);
+
+        for (l = lru.prev; l != &lru && (l->dirty | l->wb); l = l->prev)
+                ;
+        if (l == &lru)
+                return 0;
+        if (l->valid)
+                line_unhash(l);
+        l->unit = unit;
+        l->sector = sector;
+        l->valid = 0;
+        l->hnext = hash[h];
+        hash[h] = l;
+        return l;
+}
+
+static void     line_touch(ide_cline_t *l)
+{
+        lru_remove(l);
+        lru_insert(&lru, l);
+}
+
+/* Set l's dirty and write-back masks, keeping count of dirty lines */
+static void     line_mark(ide_cline_t *l, unsigned int dirty, unsigned int wb)
+{
+        int was = (l->dirty | l->wb) != 0;
+        int now = (dirty | wb) != 0;
+
+        l->dirty = dirty;
+        l->wb = wb;
+        if (was == now)
+                return;
+        if (now) {
+                ndirty++;
+                unit_dirty[l->unit % IDE_CACHE_UNITS]++;
+        } else {
+                ndirty--;
+                unit_dirty[l->unit % IDE_CACHE_UNITS]--;
+        }
+}
+
+/* Drop the sectors in mask from l, and if it's empty, free it */
+static void     line_drop(ide_cline_t *l, unsigned int mask)
+{
+        line_mark(l, l->dirty & ~mask, l->wb & ~mask);
+        l->valid &= ~mask;
+        if (l->valid)
+                return;
+        line_unhash(l);
+        lru_remove(l);
+        lru_insert(lru.prev, l);
+}
+
+/* Set up the cache in the given memory.  Returns the number of lines. */
+unsigned int    ide_cache_init(u8 *mem, unsigned int bytes)
+{
+        unsigned int n = bytes / ide_cache_size(1);
+        unsigned int i;
+
+        nlines = 0;
+        ndirty = 0;
+        for (i = 0; i < IDE_CACHE_UNITS; i++)
+                unit_dirty[i] = 0;
+        lru.next = lru.prev = &lru;
+        if (n == 0)
+                return 0;
+
+        /* Data first, keeping it aligned, then line headers and hash */
+        lines = (ide_cline_t *)(mem + n * LINE_BYTES);
+        hash = (ide_cline_t **)(lines + n);
+        for (hash_mask = 1; hash_mask*2 <= n; hash_mask *= 2)
+                ;
+        for (i = 0; i < hash_mask; i++)
+                hash[i] = 0;
+        hash_mask--;
+
+        for (i = 0; i < n; i++) {
+                lines[i].data = mem + i * LINE_BYTES;
+                lines[i].valid = 0;
+                lines[i].dirty = 0;
+                lines[i].wb = 0;
+                lines[i].hnext = 0;
+                lru_insert(lru.prev, &lines[i]);
+        }
+        nlines = n;
+        ide_cache_hits = ide_cache_misses = 0;
+        return n;
+}
+
+/* Copy sectors out of the cache, if they're all there.  Returns 1 if so,
+ * else 0 (and nothing's copied).
+ */
+int     ide_cache_read(unsigned int unit, unsigned int sector, unsigned int count,
+                       u8 *dest)
+{
+        ide_cline_t *l;
+        unsigned int s, n, m, off, mask;
+
+        if (nlines == 0 || count == 0)
+                return 0;
+
+        for (s = sector, n = count; n > 0; s += m, n -= m) {
+                off = s % IDE_CACHE_LINE;
+                m = IDE_CACHE_LINE - off;
+                if (m > n)
+                        m = n;
+                mask = ((1 << m) - 1) << off;
+                l = line_find(unit, s - off);
+                if (!l || (l->valid & mask) != mask) {
+                        ide_cache_misses++;
+                        return 0;
+                }
+        }
+
+        for (s = sector, n = count; n > 0; s += m, n -= m) {
+                off = s % IDE_CACHE_LINE;
+                m = IDE_CACHE_LINE - off;
+                if (m > n)
+                        m = n;
+                l = line_find(unit, s - off);
+                memcpy(dest, l->data + off * D_SECSIZE, m * D_SECSIZE);
+                dest += m * D_SECSIZE;
+                line_touch(l);
+        }
+        ide_cache_hits++;
+        return 1;
+}
+
+/* Put sectors into the cache; if overwrite is clear, sectors already
+ * cached are left alone.  If dirty is set, the sectors written are marked
+ * dirty (and the caller has checked there are enough clean lines).  If
+ * alloc is clear, only lines already in the cache are written.  Sectors
+ * that won't fit are skipped.
+ */
+static void     cache_put(unsigned int unit, unsigned int sector, unsigned int count,
+                          u8 *src, int overwrite, int dirty, int alloc)
+{
+        ide_cline_t *l;
+        unsigned int s, n, m, off, i;
+
+        if (nlines == 0)
+                return;
+
+        for (s = sector, n = count; n > 0; s += m, n -= m, src += m * D_SECSIZE) {
+                off = s % IDE_CACHE_LINE;
+                m = IDE_CACHE_LINE - off;
+                if (m > n)
+                        m = n;
+                l = line_find(unit, s - off);
+                if (!l && alloc)
+                        l = line_alloc(unit, s - off);
+                if (!l)
+                        continue;
+                for (i = 0; i < m; i++) {
+                        if (!overwrite && (l->valid & (1 << (off + i))))
+                                continue;
+                        memcpy(l->data + (off + i) * D_SECSIZE, src + i * D_SECSIZE,
+                               D_SECSIZE);
+                        l->valid |= 1 << (off + i);
+                }
+                if (dirty)
+                        line_mark(l, l->dirty | (((1 << m) - 1) << off), l->wb);
+                line_touch(l);
+        }
+}
+
+/* Data just read from the disc.  Any of these sectors already cached were
+ * put there by a write since the read was issued, so are newer: keep them.
+ */
+void    ide_cache_fill(unsigned int unit, unsigned int sector, unsigned int count,
+                       u8 *src)
+{
+        cache_put(unit, sector, count, src, 0, 0, 1);
+}
+
+/* Data about to be written to the disc.  Call this before the write is
+ * issued, so a read completing in the meantime can't leave older data in
+ * the cache; if the write fails, invalidate the sectors.
+ */
+void    ide_cache_write(unsigned int unit, unsigned int sector, unsigned int count,
+                        u8 *src)
+{
+        cache_put(unit, sector, count, src, 1, 0, 1);
+}
+
+/* As ide_cache_write(), but only sectors in lines already cached are
+ * updated: for raw writes, which would otherwise push out everything else.
+ */
+void    ide_cache_update(unsigned int unit, unsigned int sector, unsigned int count,
+                         u8 *src)
+{
+        cache_put(unit, sector, count, src, 1, 0, 0);
+}
+
+/* Take a write, to be written back later.  Returns 1 if so, or 0 if
+ * there's no room (at most 3/4 of the cache is let get dirty), in which
+ * case nothing's changed and the caller should write it through.
+ */
+int     ide_cache_write_behind(unsigned int unit, unsigned int sector,
+                               unsigned int count, u8 *src)
+{
+        unsigned int span;
+
+        if (nlines == 0 || count == 0)
+                return 0;
+        /* Lines the write might need, allocated or not */
+        span = (sector % IDE_CACHE_LINE + count + IDE_CACHE_LINE - 1) / IDE_CACHE_LINE;
+        if (ndirty + span > nlines - nlines/4)
+                return 0;
+        cache_put(unit, sector, count, src, 1, 1, 1);
+        return 1;
+}
+
+/* A read from the disc has put the sectors into dest: copy over them any
+ * that are still to be written back, as those are newer.
+ */
+void    ide_cache_overlay(unsigned int unit, unsigned int sector, unsigned int count,
+                          u8 *dest)
+{
+        ide_cline_t *l;
+        unsigned int s, n, m, off, i, pend;
+
+        if (ndirty == 0 || unit_dirty[unit % IDE_CACHE_UNITS] == 0)
+                return;
+
+        for (s = sector, n = count; n > 0; s += m, n -= m, dest += m * D_SECSIZE) {
+                off = s % IDE_CACHE_LINE;
+                m = IDE_CACHE_LINE - off;
+                if (m > n)
+                        m = n;
+                l = line_find(unit, s - off);
+                if (!l)
+                        continue;
+                pend = l->dirty | l->wb;
+                for (i = 0; i < m; i++) {
+                        if (pend & (1 << (off + i)))
+                                memcpy(dest + i * D_SECSIZE,
+                                       l->data + (off + i) * D_SECSIZE, D_SECSIZE);
+                }
+        }
+}
+
+/* Lines of unit's holding sectors still to reach the disc */
+unsigned int    ide_cache_dirty(unsigned int unit)
+{
+        return unit_dirty[unit % IDE_CACHE_UNITS];
+}
+
+/* Dirty lines in the whole cache, and the cache size, in lines */
+unsigned int    ide_cache_dirty_lines(unsigned int *total)
+{
+        if (total)
+                *total = nlines;
+        return ndirty;
+}
+
+/* Find a run of up to max consecutive dirty sectors of unit's, copy them
+ * to dest and mark them as being written back.  Runs are taken in
+ * ascending order from sector from, wrapping round to the lowest (as the
+ * request queue is).  Returns the number of sectors, and the first in
+ * *sector, or 0 if there are none.
+ */
+unsigned int    ide_cache_flush_run(unsigned int unit, unsigned int from,
+                                    unsigned int *sector, u8 *dest, unsigned int max)
+{
+        ide_cline_t *l, *best = 0, *low = 0;
+        unsigned int i, s, off, n;
+
+        if (unit_dirty[unit % IDE_CACHE_UNITS] == 0)
+                return 0;
+
+        for (i = 0; i < nlines; i++) {
+                l = &lines[i];
+                if (!l->dirty || l->unit != unit)
+                        continue;
+                if (!low || l->sector < low->sector)
+                        low = l;
+                if (l->sector + IDE_CACHE_LINE > from &&
+                    (!best || l->sector < best->sector))
+                        best = l;
+        }
+        if (!best)
+                best = low;
+        if (!best)
+                return 0;
+
+        for (off = 0; !(best->dirty & (1 << off)); off++)
+                ;
+        *sector = s = best->sector + off;
+        for (l = best, n = 0; n < max; n++, s++, dest += D_SECSIZE) {
+                off = s % IDE_CACHE_LINE;
+                if (l->sector != s - off)
+                        l = line_find(unit, s - off);
+                if (!l || !(l->dirty & (1 << off)))
+                        break;
+                memcpy(dest, l->data + off * D_SECSIZE, D_SECSIZE);
+                line_mark(l, l->dirty & ~(1 << off), l->wb | (1 << off));
+        }
+        return n;
+}
+
+/* A run from ide_cache_flush_run() has been written, or not (ok clear).
+ * The sectors are clean, unless they've been written again meanwhile; if
+ * the write failed, what's on the disc isn't known so they're dropped.
+ */
+void    ide_cache_flush_done(unsigned int unit, unsigned int sector,
+                             unsigned int count, int ok)
+{
+        ide_cline_t *l;
+        unsigned int s, n, m, off, mask;
+
+        for (s = sector, n = count; n > 0; s += m, n -= m) {
+                off = s % IDE_CACHE_LINE;
+                m = IDE_CACHE_LINE - off;
+                if (m > n)
+                        m = n;
+                mask = ((1 << m) - 1) << off;
+                l = line_find(unit, s - off);
+                if (!l)
+                        continue;
+                line_mark(l, l->dirty, l->wb & ~mask);
+                if (!ok)
+                        line_drop(l, mask & ~l->dirty);
+        }
+}
+
+void    ide_cache_invalidate(unsigned int unit, unsigned int sector, unsigned int count)
+{
+        ide_cline_t *l;
+        unsigned int s, n, m, off;
+
+        if (nlines == 0)
+                return;
+
+        for (s = sector, n = count; n > 0; s += m, n -= m) {
+                off = s % IDE_CACHE_LINE;
+                m = IDE_CACHE_LINE - off;
+                if (m > n)
+                        m = n;
+                l = line_find(unit, s - off);
+                /* Anything still to be written back is the newest copy */
+                if (l)
+                        line_drop(l, (((1 << m) - 1) << off) & ~(l->dirty | l->wb));
+        }
+}
+
+/* Forget everything cached for unit, dirty or not */
+void    ide_cache_purge(unsigned int unit)
+{
+        unsigned int i;
+
+        for (i = 0; i < nlines; i++) {
+                if (lines[i].valid && lines[i].unit == unit) {
+                        line_mark(&lines[i], 0, 0);
+                        line_drop(&lines[i], lines[i].valid);
+                }
+        }
+}
+
+
+/*
+ * Read-ahead.
+ *
+ * For each drive, the last few sequential streams of reads are tracked
+ * (several, as e.g. a compile reads sources and headers at the same time).
+ * A stream is an expected next sector, and it's only recognised as one
+ * once a read follows on from the previous.  ide_ra_note() is told of
+ * every read, whether it hits the cache or not.  When a read follows on
+ * from a stream, ide_ra_want() says how much the caller should read
+ * beyond it into the cache.  That's IDE_RA_MIN sectors the first time,
+ * doubling each time the reader comes back for more, up to the caller's
+ * limit.
+ */
+#define IDE_RA_STREAMS  4
+#define IDE_RA_MIN      16
+
+typedef struct {
+        unsigned int    next;           /* Sector after the last read */
+        unsigned int    seq;            /* Reads that have followed on */
+        unsigned int    ra;             /* Last read-ahead size */
+        unsigned int    used;           /* For replacing the oldest */
+} ide_stream_t;
+
+static ide_stream_t     streams[IDE_CACHE_UNITS][IDE_RA_STREAMS];
+static unsigned int     stream_clock;
+
+static ide_stream_t *stream_find(unsigned int unit, unsigned int sector)
+{
+        ide_stream_t *st = streams[unit % IDE_CACHE_UNITS];
+        int i;
+
+        for (i = 0; i < IDE_RA_STREAMS; i++) {
+                if (st[i].used && st[i].next == sector)
+                        return &st[i];
+        }
+        return 0;
+}
+
+void    ide_ra_note(unsigned int unit, unsigned int sector, unsigned int count)
+{
+        ide_stream_t *st = stream_find(unit, sector);
+        ide_stream_t *old;
+        int i;
+
+        if (count == 0)
+                return;
+        if (st) {
+                st->seq++;
+        } else {
+                /* A new stream, replacing the least recently used */
+                old = st = streams[unit % IDE_CACHE_UNITS];
+                for (i = 1; i < IDE_RA_STREAMS; i++) {
+                        if (st[i].used < old->used)
+                                old = &st[i];
+                }
+                st = old;
+                st->seq = 0;
+                st->ra = 0;
+        }
+        st->next = sector + count;
+        st->used = ++stream_clock;
+}
+
+/* A read finishing at sector is about to be issued: returns the number of
+ * sectors (up to max) to read ahead after it, or 0.
+ */
+unsigned int ide_ra_want(unsigned int unit, unsigned int sector, unsigned int max)
+{
+        ide_stream_t *st = stream_find(unit, sector);
+
+        if (!st || st->seq == 0 || nlines == 0)
+                return 0;
+        st->ra = st->ra ? st->ra * 2 : IDE_RA_MIN;
+        if (st->ra > max)
+                st->ra = max;
+        return st->ra;
+}
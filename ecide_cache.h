@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2022 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef ECIDE_CACHE_H
+#define ECIDE_CACHE_H
+
+#include "ecide.h"
+
+/* Sectors per cache line (a power of two) */
+#define IDE_CACHE_LINE          8
+
+/* Cache units are drives, numbered card*2 + drive */
+#define IDE_CACHE_UNIT(card, drive)     ((card)*2 + (drive))
+#define IDE_CACHE_UNITS                 8
+
+/* Bytes of memory for a cache of n lines (headers, hash table and data) */
+unsigned int    ide_cache_size(unsigned int lines);
+unsigned int    ide_cache_init(u8 *mem, unsigned int bytes);
+int     ide_cache_read(unsigned int unit, unsigned int sector, unsigned int count,
+                       u8 *dest);
+void    ide_cache_fill(unsigned int unit, unsigned int sector, unsigned int count,
+                       u8 *src);
+void    ide_cache_write(unsigned int unit, unsigned int sector, unsigned int count,
+                        u8 *src);
+void    ide_cache_update(unsigned int unit, unsigned int sector, unsigned int count,
+                         u8 *src);
+int     ide_cache_write_behind(unsigned int unit, unsigned int sector,
+                               unsigned int count, u8 *src);
+void    ide_cache_overlay(unsigned int unit, unsigned int sector, unsigned int count,
+                          u8 *dest);
+unsigned int    ide_cache_dirty(unsigned int unit);
+unsigned int    ide_cache_dirty_lines(unsigned int *total);
+unsigned int    ide_cache_flush_run(unsigned int unit, unsigned int from,
+                                    unsigned int *sector, u8 *dest, unsigned int max);
+void    ide_cache_flush_done(unsigned int unit, unsigned int sector,
+                             unsigned int count, int ok);
+void    ide_cache_invalidate(unsigned int unit, unsigned int sector, unsigned int count);
+void    ide_cache_purge(unsigned int unit);
+void    ide_ra_note(unsigned int unit, unsigned int sector, unsigned int count);
+unsigned int ide_ra_want(unsigned int unit, unsigned int sector, unsigned int max);
+
+extern unsigned int ide_cache_hits;
+extern unsigned int ide_cache_misses;
+
+#endif
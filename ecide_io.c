@@ -2,7 +2,8 @@
  *
  * PIO IDE probing/identification and data transfer routines.
  *
- * Polled, currently; IRQs TODO.
+ * Transfers are driven one DRQ block at a time by ide_xfer_service(), either
+ * from the card's IRQ handler or by polling (ide_read_some() and friends).
  *
  * Copyright (c) 2022 Matt Evans
  *
@@ -40,24 +41,147 @@ extern void DELAY_(int);
 #define DELAYUS DELAY_
 
 
-/* Returns -1 on timeout, else 0 */
-int     ide_wait_nbsy(regs_t regs)
+/*
+ * Waiting for the device.
+ *
+ * Most waits (for the next DRQ block from a drive's buffer, or from flash)
+ * are a few tens of microseconds, and it's quickest to spin.  A seek, or a
+ * drive spinning up, takes many milliseconds, so after IDE_SPIN_MAX the
+ * wait calls ide_yield(), which lets another process run for a clock tick
+ * (if the caller can sleep; it returns 0 otherwise).
+ *
+ * Each drive keeps an estimate of its typical wait, wait_est, moving a
+ * quarter of the way to each new sample.  If that's long, the drive
+ * usually seeks before it responds, so waits only spin for IDE_SPIN_MIN
+ * before yielding.  Those that then yield say little about the drive, so
+ * aren't sampled; instead, every eighth wait spins the full IDE_SPIN_MAX
+ * to measure it again, so the estimate falls if the drive speeds up.
+ *
+ * Waits count turns of the polling loop, whose speed depends on the CPU
+ * and the card's bus speed, so ide_calibrate() times it against
+ * ide_timer() to get ih->loops_ms, the turns in a millisecond.  Timeouts
+ * are then real times, in one of the classes in ecide_io.h.
+ */
+#define IDE_SPIN_MIN            50              /* us */
+#define IDE_SPIN_MAX            2000
+#define IDE_LOOPS_MS_DEFAULT    1000            /* If uncalibrated: 1us a turn */
+
+#define IDE_LOOPS(ih, us)       ((us) * (ih)->loops_ms / 1000)
+
+/* Time the polling loop below, for this card */
+void    ide_calibrate(ide_host_t *ih)
 {
-        int timeout = 1000*1000; /* 1000ms */
+        unsigned int period, t0, t1, n, i;
+        unsigned int us = 0;
+
+        ih->loops_ms = IDE_LOOPS_MS_DEFAULT;
+        (void)ide_timer(&period);
+        if (period == 0)
+                return;
+        /* Long enough to measure (a millisecond), but not so long the
+         * timer might wrap more than once:
+         */
+        for (n = 64; n < 0x100000; n *= 2) {
+                t0 = ide_timer(&period);
+                for (i = 0; i < n; i++) {
+                        (void)read_reg8(ih->regs, wd_status);
+                        DELAYUS(1);
+                }
+                t1 = ide_timer(&period);
+                us = (t1 + period - t0) % period;
+                if (us >= 1000 || us >= period/4)
+                        break;
+        }
+        if (us > 0 && n*1000/us > 0)
+                ih->loops_ms = n*1000/us;
+        DBG("ecide%d: %d polling loops/ms\n", ih->card_num, ih->loops_ms);
+}
+
+/* Move the drive's wait_est towards a wait of t turns of the polling loop */
+static void     ide_wait_sample(ide_host_t *ih, drive_info_t *di, unsigned int t)
+{
+        /* To us, without overflowing on a long wait */
+        t = t / ih->loops_ms * 1000 +
+                (t % ih->loops_ms) * 1000 / ih->loops_ms;
+        if (t > IDE_SPIN_MAX*2)
+                t = IDE_SPIN_MAX*2;
+        di->wait_est = (di->wait_est*3 + t) / 4;
+}
+
+/* Wait for !BSY or, with drq set, !BSY and DRQ (or an error), for up to
+ * ms milliseconds.
+ * Returns -1 on timeout, 0 on success, or, with drq set, status<<8 | error
+ * if the status has ERR/DF set.
+ */
+static int      ide_wait(ide_host_t *ih, int drq, unsigned int ms)
+{
+        drive_info_t *di = ih->cur_drive >= 0 ? &ih->drives[ih->cur_drive] : 0;
+        unsigned int limit = ~0U;
+        unsigned int spin = IDE_LOOPS(ih, IDE_SPIN_MAX);
+        unsigned int t = 0;
         unsigned int s;
+        int r, y;
+        int yielded = 0;
+
+        if (ms < ~0U / ih->loops_ms)
+                limit = ms * ih->loops_ms;      /* Else near enough forever */
+        if (di && di->wait_est > IDE_SPIN_MAX/2 && (++di->wait_n & 7) != 0)
+                spin = IDE_LOOPS(ih, IDE_SPIN_MIN);
 
+        for (;;) {
+                /* Look for:
+                 * BSY=0, DRQ=1 (yay, carry on)
+                 * ERR=1 or DF=1 (d'oh, return error)
+                 */
+                s = read_reg8(ih->regs, wd_status);
+                if (!(s & WDCS_BUSY)) {
+                        if (!drq) {
+                                r = 0;
+                                break;
+                        }
+                        if ((s & WDCS_ERR) || (s & WDCS_DRVFLT)) {
+                                r = (s << 8) | read_reg8(ih->regs, wd_error);
+                                break;
+                        }
+                        if (s & WDCS_DRQ) {
+                                r = 0;
+                                break;
+                        }
+                }
+                if (t >= limit)
+                        return -1;
+                if (t >= spin && (y = ide_yield(ih)) > 0) {
+                        t += IDE_LOOPS(ih, y);
+                        yielded = 1;
+                } else {
+                        DELAYUS(1);
+                        t++;
+                }
+        }
+
+        /* Only sample real waits, not a quick look at an idle drive */
+        if (di && t > 0 && (spin == IDE_LOOPS(ih, IDE_SPIN_MAX) || !yielded))
+                ide_wait_sample(ih, di, t);
+        return r;
+}
+
+/* Returns -1 on timeout, else 0 */
+static int      ide_poll_nbsy(ide_host_t *ih, unsigned int ms)
+{
+        return ide_wait(ih, 0, ms);
+}
+
+/* As above, after the drive's had a chance to update status (e.g. after
+ * drive select, or a data block).  Returns -1 on timeout, else 0.
+ */
+int     ide_wait_nbsy(ide_host_t *ih, unsigned int ms)
+{
         /* Burn 400ns  after drive select */
-        s = read_reg8(regs, wd_status);
-        s = read_reg8(regs, wd_status);
-        s = read_reg8(regs, wd_status);
+        (void)read_reg8(ih->regs, wd_status);
+        (void)read_reg8(ih->regs, wd_status);
+        (void)read_reg8(ih->regs, wd_status);
 
-        do {
-                s = read_reg8(regs, wd_status);
-                if (!(s & WDCS_BUSY))
-                        return 0;
-                DELAYUS(1);
-        } while(--timeout > 0);
-        return -1;
+        return ide_wait(ih, 0, ms);
 }
 
 /* Slight variation: wait for !Busy and DRQ, but also
@@ -67,71 +191,54 @@ int     ide_wait_nbsy(regs_t regs)
  * Returns -1 on timeout, 0 on success, or contents of error
  * register + status register if ERR/DF bits set in status.
  */
-int     ide_wait_drq(regs_t regs)
+int     ide_wait_drq(ide_host_t *ih, unsigned int ms)
 {
-        int timeout = 1000*1000; /* 1000ms */
-        unsigned int s;
-
         /* Wait for status to "settle", in particular legend has it that
          * ERR/DF bits will take some time to update after a command.
          */
-        s = read_reg8(regs, wd_status);
-        s = read_reg8(regs, wd_status);
-        s = read_reg8(regs, wd_status);
-        s = read_reg8(regs, wd_status);
+        (void)read_reg8(ih->regs, wd_status);
+        (void)read_reg8(ih->regs, wd_status);
+        (void)read_reg8(ih->regs, wd_status);
+        (void)read_reg8(ih->regs, wd_status);
 
-        do {
-                /* Look for:
-                 * BSY=0, DRQ=1 (yay, carry on)
-                 * ERR=1 or DF=1 (d'oh, return error)
-                 */
-                s = read_reg8(regs, wd_status);
-                if (!(s & WDCS_BUSY)) {
-                        if ((s & WDCS_ERR) || (s & WDCS_DRVFLT))
-                                return (s << 8) | read_reg8(regs, wd_error);
-                        if (s & WDCS_DRQ)
-                                return 0;
-                }
-
-                DELAYUS(1);
-        } while(--timeout > 0);
-        return -1;
+        return ide_wait(ih, 1, ms);
 }
 
 
 #ifdef GENERIC_C_PIO_TRANSFERS
-/* Read a sector-sized chunk (512B) */
-static void     ide_read_data(regs_t regs, unsigned char *dest)
+/* Read n sector-sized chunks (n * 512B) */
+static void     ide_read_sectors(regs_t regs, unsigned char *dest, unsigned int n)
 {
-        int i;
+        unsigned int i;
         unsigned int *d = (unsigned int *)dest;
 
-        for (i = 0; i < 512/4; i++) {
+        for (i = 0; i < n*(512/4); i++) {
                 unsigned int w = read_reg16(regs, wd_data);
                 w |= ((unsigned int)read_reg16(regs, wd_data)) << 16;
                 *d++ = w;
         }
 }
 
-static void     ide_write_data(regs_t regs, unsigned char *src)
+static void     ide_write_sectors(regs_t regs, unsigned char *src, unsigned int n)
 {
-        int i;
+        unsigned int i;
         unsigned int *d = (unsigned int *)src;
 
-        for (i = 0; i < 512/4; i++) {
+        for (i = 0; i < n*(512/4); i++) {
                 unsigned int w = *d++;
                 write_reg16(regs, wd_data, w & 0xffff);
                 write_reg16(regs, wd_data, (w >> 16));
         }
 }
 
-/* Read a sector-sized chunk (512B), with a high-byte latch */
-static void     ide_read_data8(regs_t regs, regs_t hbl, unsigned char *dest)
+/* Read n sector-sized chunks (n * 512B), with a high-byte latch */
+static void     ide_read_sectors8(regs_t regs, regs_t hbl, unsigned char *dest,
+                                  unsigned int n)
 {
-        int i;
+        unsigned int i;
         unsigned int *dp = (unsigned int *)dest;
 
-        for (i = 0; i < 512/4; i++) {
+        for (i = 0; i < n*(512/4); i++) {
                 /* Read of the data reg latches data in the high-byte latch: */
                 unsigned int w, x, y, z;
                 w = read_reg8(regs, wd_data);
@@ -145,12 +252,13 @@ static void     ide_read_data8(regs_t regs, regs_t hbl, unsigned char *dest)
         }
 }
 
-static void     ide_write_data8(regs_t regs, regs_t hbl, unsigned char *src)
+static void     ide_write_sectors8(regs_t regs, regs_t hbl, unsigned char *src,
+                                   unsigned int n)
 {
-        int i;
+        unsigned int i;
         unsigned int *d = (unsigned int *)src;
 
-        for (i = 0; i < 512/4; i++) {
+        for (i = 0; i < n*(512/4); i++) {
                 unsigned int w = *d++;
                 /* Writing the data reg combines with previous high-byte value */
                 write_reg8(hbl, 0, (w >> 8) & 0xff);
@@ -159,13 +267,97 @@ static void     ide_write_data8(regs_t regs, regs_t hbl, unsigned char *src)
                 write_reg8(regs, wd_data, (w >> 16) & 0xff);
         }
 }
+
+/* Read n sectors through an aliased data window, 8 halfwords per burst */
+static void     ide_read_burst(regs_t win, unsigned char *dest, unsigned int n)
+{
+        unsigned int i, j;
+        unsigned int *d = (unsigned int *)dest;
+
+        for (i = 0; i < n*(512/16); i++) {
+                for (j = 0; j < 8; j += 2) {
+                        unsigned int w = read_reg16(win, j);
+                        w |= ((unsigned int)read_reg16(win, j + 1)) << 16;
+                        *d++ = w;
+                }
+        }
+}
+
+static void     ide_write_burst(regs_t win, unsigned char *src, unsigned int n)
+{
+        unsigned int i, j;
+        unsigned int *d = (unsigned int *)src;
+
+        for (i = 0; i < n*(512/16); i++) {
+                for (j = 0; j < 8; j += 2) {
+                        unsigned int w = *d++;
+                        write_reg16(win, j, w & 0xffff);
+                        write_reg16(win, j + 1, (w >> 16));
+                }
+        }
+}
 #else
-extern void     ide_read_data(regs_t regs, unsigned char *dest);
-extern void     ide_write_data(regs_t regs, unsigned char *src);
-extern void     ide_read_data8(regs_t regs, regs_t hbl, unsigned char *dest);
-extern void     ide_write_data8(regs_t regs, regs_t hbl, unsigned char *src);
+extern void     ide_read_sectors(regs_t regs, unsigned char *dest, unsigned int n);
+extern void     ide_write_sectors(regs_t regs, unsigned char *src, unsigned int n);
+extern void     ide_read_sectors8(regs_t regs, regs_t hbl, unsigned char *dest,
+                                  unsigned int n);
+extern void     ide_write_sectors8(regs_t regs, regs_t hbl, unsigned char *src,
+                                   unsigned int n);
+extern void     ide_read_burst(regs_t win, unsigned char *dest, unsigned int n);
+extern void     ide_write_burst(regs_t win, unsigned char *src, unsigned int n);
 #endif
 
+/* Data-phase ops for each kind of data path */
+static void     ide_rd16(ide_host_t *ih, u8 *dest, unsigned int n)
+{
+        ide_read_sectors(ih->data_regs, dest, n);
+}
+
+static void     ide_wr16(ide_host_t *ih, u8 *src, unsigned int n)
+{
+        ide_write_sectors(ih->data_regs, src, n);
+}
+
+static void     ide_rd8(ide_host_t *ih, u8 *dest, unsigned int n)
+{
+        ide_read_sectors8(ih->data_regs, ih->hi_latch_read, dest, n);
+}
+
+static void     ide_wr8(ide_host_t *ih, u8 *src, unsigned int n)
+{
+        ide_write_sectors8(ih->data_regs, ih->hi_latch_write, src, n);
+}
+
+static void     ide_rd_burst(ide_host_t *ih, u8 *dest, unsigned int n)
+{
+        ide_read_burst(ih->rd_window, dest, n);
+}
+
+static void     ide_wr_burst(ide_host_t *ih, u8 *src, unsigned int n)
+{
+        ide_write_burst(ih->wr_window, src, n);
+}
+
+/* Choose the host's sector transfer ops, from its latches/windows.  Call
+ * again whenever those change.
+ */
+void    ide_set_data_ops(ide_host_t *ih)
+{
+        if (ih->rd_window)
+                ih->ops.read_sectors = ide_rd_burst;
+        else if (!ih->hi_latch_read)
+                ih->ops.read_sectors = ide_rd16;
+        else
+                ih->ops.read_sectors = ide_rd8;
+
+        if (ih->wr_window)
+                ih->ops.write_sectors = ide_wr_burst;
+        else if (!ih->hi_latch_write)
+                ih->ops.write_sectors = ide_wr16;
+        else
+                ih->ops.write_sectors = ide_wr8;
+}
+
 static void ide_copy_string(char *dst, u16 *src, int num_hwords)
 {
         int i;
@@ -189,6 +381,79 @@ static void ide_copy_string(char *dst, u16 *src, int num_hwords)
         dst[num_hwords*2] = 0;
 }
 
+/*
+ * Known devices (see ide_quirk_t); the first match is used.
+ *
+ * Drives that claim faster PIO modes than they manage (from the Linux IDE
+ * driver's PIO blacklist):
+ */
+static const ide_quirk_t ide_quirks[] = {
+        { "Conner Peripherals 540MB - CFS540A", 0, 0, 0, 3, 0 },
+        { "WDC AC2700",         0, 0, 0, 3, 0 },
+        { "WDC AC2540",         0, 0, 0, 3, 0 },
+        { "WDC AC2420",         0, 0, 0, 3, 0 },
+        { "WDC AC2340",         0, 0, 0, 3, 0 },
+        { "WDC AC2250",         0, 0, 0, 0, 0 },
+        { "WDC AC2200",         0, 0, 0, 0, 0 },
+        { "WDC AC21200",        0, 0, 0, 4, 0 },
+        { "WDC AC2120",         0, 0, 0, 0, 0 },
+        { "WDC AC2850",         0, 0, 0, 3, 0 },
+        { "WDC AC1270",         0, 0, 0, 3, 0 },
+        { "WDC AC1170",         0, 0, 0, 1, 0 },
+        { "WDC AC1210",         0, 0, 0, 1, 0 },
+        { "WDC AC280",          0, 0, 0, 0, 0 },
+        { "WDC AC31000",        0, 0, 0, 3, 0 },
+        { "WDC AC31200",        0, 0, 0, 3, 0 },
+        { "Maxtor 7131 AT",     0, 0, 0, 1, 0 },
+        { "Maxtor 7171 AT",     0, 0, 0, 1, 0 },
+        { "Maxtor 7213 AT",     0, 0, 0, 1, 0 },
+        { "Maxtor 7245 AT",     0, 0, 0, 1, 0 },
+        { "Maxtor 7345 AT",     0, 0, 0, 1, 0 },
+        { "Maxtor 7546 AT",     0, 0, 0, 3, 0 },
+        { "Maxtor 7540 AV",     0, 0, 0, 3, 0 },
+        { 0, 0, 0, 0, 0, 0 }
+};
+
+static const ide_quirk_t *ide_quirk_table = ide_quirks;
+
+#ifdef ECIDE_SIM
+void    ide_set_quirks(const ide_quirk_t *table)
+{
+        ide_quirk_table = table ? table : ide_quirks;
+}
+#endif
+
+static int ide_prefix(const char *s, const char *prefix)
+{
+        while (*prefix) {
+                if (*s++ != *prefix++)
+                        return 0;
+        }
+        return 1;
+}
+
+static void ide_apply_quirks(drive_info_t *di, const char *model, const char *fw)
+{
+        const ide_quirk_t *q;
+
+        di->quirks = 0;
+        di->max_sectors = 0;
+        di->settle_us = 0;
+        for (q = ide_quirk_table; q->model; q++) {
+                if (ide_prefix(model, q->model) && (!q->fw || ide_prefix(fw, q->fw)))
+                        break;
+        }
+        if (!q->model)
+                return;
+        di->quirks = q->quirks;
+        di->max_sectors = q->max_sectors;
+        di->settle_us = q->settle_us;
+        if (q->pio_max != IDE_PIO_ANY && di->pio_max > q->pio_max)
+                di->pio_max = q->pio_max;
+        DBG("ecide: quirks for '%s': %x, %d sectors, PIO%d, settle %dus\n", model,
+            di->quirks, di->max_sectors, di->pio_max, di->settle_us);
+}
+
 static void ide_parse_identify(u16 *buff, drive_info_t *di, int card)
 {
         char id_strb[41];
@@ -197,15 +462,66 @@ static void ide_parse_identify(u16 *buff, drive_info_t *di, int card)
         u16 heads = buff[3];
         u16 lsplt = buff[6];
         u16 caps = buff[49];
+        u16 multi = buff[47] & 0xff;
+        u16 pio = buff[51] >> 8;        /* Obsolete, but all there is on old drives */
         u32 lba_sectors = buff[60] | (unsigned int)buff[61] << 16;
+        /* 48-bit feature set supported (w83) and enabled (w86)?  Capacity's
+         * in w100-103, but we're limited to 32 bits of it.
+         */
+        int lba48 = (buff[83] & 0xc000) == 0x4000 && (buff[83] & (1<<10)) &&
+                (buff[86] & (1<<10));
 
         di->cyl = cyl;
         di->heads = heads;
         di->sec_per_track = lsplt;
+        di->multi_max = multi;
+        di->multi = 0;
+
+        /* PIO 3/4 are advertised in w64 (if w53 says it's valid); believe
+         * them only if the IORDY cycle time in w68 agrees.
+         */
+        if (pio > 2)
+                pio = 2;
+        if (buff[53] & (1<<1)) {
+                if ((buff[64] & (1<<1)) && (buff[68] == 0 || buff[68] <= 120))
+                        pio = 4;
+                else if ((buff[64] & (1<<0)) && (buff[68] == 0 || buff[68] <= 180))
+                        pio = 3;
+        }
+        di->pio_max = pio;
+        di->pio_mode = 0;
+
+        /* Command sets supported (w82) and enabled (w85), valid if w83
+         * says so.
+         */
+        di->feat = di->feat_on = 0;
+        if ((buff[83] & 0xc000) == 0x4000) {
+                if (buff[82] & (1<<5))
+                        di->feat |= IDE_F_WCACHE;
+                if (buff[82] & (1<<6))
+                        di->feat |= IDE_F_LOOKAHEAD;
+                if (buff[85] & (1<<5))
+                        di->feat_on |= IDE_F_WCACHE;
+                if (buff[85] & (1<<6))
+                        di->feat_on |= IDE_F_LOOKAHEAD;
+                di->feat_on &= di->feat;
+        }
+        /* CompactFlash signature, or CFA feature set */
+        if (buff[0] == 0x848a ||
+            ((buff[83] & 0xc000) == 0x4000 && (buff[83] & (1<<2))))
+                di->feat |= IDE_F_CFA;
+        di->nerased = 0;
 
         if (caps & (1<<9)) {
                 di->total_sectors = lba_sectors;
                 di->lba_supported = 1;
+                di->lba48 = lba48;
+                if (lba48) {
+                        if (buff[102] || buff[103])
+                                di->total_sectors = 0xffffffff;
+                        else
+                                di->total_sectors = buff[100] | (unsigned int)buff[101] << 16;
+                }
                 if (di->heads != 16 || di->sec_per_track != 63 ||
                     di->total_sectors != cyl*heads*lsplt) {
                         DBG("*** LBA CHS info mismatch ***\n");
@@ -217,30 +533,513 @@ static void ide_parse_identify(u16 *buff, drive_info_t *di, int card)
         } else {
                 di->total_sectors = cyl*heads*lsplt;
                 di->lba_supported = 0;
+                di->lba48 = 0;
         }
+        di->spc = di->heads * di->sec_per_track;
 
         ide_copy_string(id_strb, &buff[27], 40/2);
         ide_copy_string(fw_strb, &buff[23], 8/2);
 
+        ide_apply_quirks(di, id_strb, fw_strb);
+
         printf("ecide%d: '%s', %dMB (%ld sectors, CHS %d/%d/%d)\n"
-               "        [revision '%s', caps %04x (%sLBA)]\n", card,
+               "        [revision '%s', caps %04x (%sLBA%s)]\n", card,
                id_strb, di->total_sectors/2048, di->total_sectors, cyl, heads, lsplt,
-               fw_strb, caps, di->lba_supported ? "" : "no ");
+               fw_strb, caps, di->lba_supported ? "" : "no ", di->lba48 ? "48" : "");
+}
+
+/* Taskfile shadowing: registers are only written if the shadow says they
+ * don't already hold the value.  The registers are shared by both drives.
+ */
+#define TF_ADDR         ((1 << wd_sector) | (1 << wd_cyl_lo) | (1 << wd_cyl_hi) | \
+                         (1 << wd_sdh))
+
+void    ide_tf_invalidate(ide_host_t *ih)
+{
+        ih->tf_valid = 0;
+        ih->cur_drive = -1;
+}
+
+static void     ide_tf_write(ide_host_t *ih, unsigned int reg, unsigned int v)
+{
+        if ((ih->tf_valid & (1 << reg)) && ih->tf[reg] == v)
+                return;
+        write_reg8(ih->regs, reg, v);
+        ih->tf[reg] = v;
+        ih->tf_valid |= 1 << reg;
+}
+
+/* After a read/write command completes, old drives leave the address of
+ * the last sector in the address registers, but newer ones may leave them
+ * unchanged (or undefined, if you read ATA-6 literally).  A shadowed byte
+ * is kept only where those agree, i.e. the last sector's byte is the same
+ * as the first's.  seccnt is always lost.
+ */
+static void     ide_tf_cmd_done(ide_host_t *ih, unsigned int drive, unsigned int last,
+                                int lba28)
+{
+        ih->tf_valid &= ~(1 << wd_seccnt);
+        if (!lba28) {
+                ih->tf_valid &= ~TF_ADDR;
+                return;
+        }
+        if (ih->tf[wd_sector] != (last & 0xff))
+                ih->tf_valid &= ~(1 << wd_sector);
+        if (ih->tf[wd_cyl_lo] != ((last >> 8) & 0xff))
+                ih->tf_valid &= ~(1 << wd_cyl_lo);
+        if (ih->tf[wd_cyl_hi] != ((last >> 16) & 0xff))
+                ih->tf_valid &= ~(1 << wd_cyl_hi);
+        if (ih->tf[wd_sdh] != DRVBLK_LBA(drive, last >> 24))
+                ih->tf_valid &= ~(1 << wd_sdh);
 }
 
 static void     ide_select_drive(ide_host_t *ih, unsigned int drive)
 {
-        write_reg8(ih->regs, wd_sdh, DRVHD(drive, 0));
+        ide_tf_write(ih, wd_sdh, DRVHD(drive, 0));
+        ih->cur_drive = drive;
+}
+
+/* Select drive and wait for it to be ready for a command.  If it's
+ * already selected there's no need to wait for the selection to settle.
+ * Some devices want a while longer (see ide_quirks[]).
+ * Returns -1 on timeout, else 0.
+ */
+static int      ide_select_wait(ide_host_t *ih, unsigned int drive)
+{
+        int r;
+
+        if (ih->cur_drive == (int)drive) {
+                r = ide_poll_nbsy(ih, IDE_TMO_SHORT);
+        } else {
+                ide_select_drive(ih, drive);
+                r = ide_wait_nbsy(ih, IDE_TMO_SHORT);
+        }
+        if (r == 0 && ih->drives[drive].settle_us)
+                DELAYUS(ih->drives[drive].settle_us);
+        return r;
+}
+
+/* Wait for a command with no data phase to complete, for up to ms
+ * milliseconds.
+ * Returns 0 for success, -1 on timeout, or status<<8 | error.
+ */
+static int      ide_nodata_wait(ide_host_t *ih, unsigned int ms)
+{
+        unsigned int s;
+
+        if (ide_wait_nbsy(ih, ms))
+                return -1;
+        s = read_reg8(ih->regs, wd_status);
+        if (s & (WDCS_ERR | WDCS_DRVFLT)) {
+                ide_tf_invalidate(ih);
+                return (s << 8) | read_reg8(ih->regs, wd_error);
+        }
+        return 0;
+}
+
+/* Issue a command with no data phase, and wait for it as above */
+static int      ide_nodata_command(ide_host_t *ih, unsigned int drive, unsigned int cmd,
+                                   unsigned int features, unsigned int count,
+                                   unsigned int ms)
+{
+        if (ide_select_wait(ih, drive))
+                return -1;
+        ide_tf_write(ih, wd_features, features);
+        ide_tf_write(ih, wd_seccnt, count);
+        write_reg8(ih->regs, wd_command, cmd);
+        ih->tf_valid &= ~(1 << wd_seccnt);
+        return ide_nodata_wait(ih, ms);
+}
+
+/* Enable READ/WRITE MULTIPLE, with the biggest power-of-two block size
+ * the drive allows (up to MULTI_LIMIT), so that a DRQ handshake moves a
+ * block of sectors rather than just one.
+ */
+#define MULTI_LIMIT     32
+
+static void     ide_set_multiple(ide_host_t *ih, unsigned int drive)
+{
+        drive_info_t *di = &ih->drives[drive];
+        unsigned int n;
+        int r;
+
+        di->multi = 0;
+        if (di->multi_max < 2 || (di->quirks & IDE_Q_NOMULTI))
+                return;
+        for (n = 2; n*2 <= di->multi_max && n*2 <= MULTI_LIMIT; n *= 2)
+                ;
+
+        r = ide_nodata_command(ih, drive, WDCC_SET_MULTI, 0, n,
+                               IDE_TMO_MEDIUM);
+        if (r) {
+                DBG("ecide%d:%d: SET MULTIPLE %d failed, %04x\n", ih->card_num, drive, n, r);
+                return;
+        }
+        di->multi = n;
+}
+
+/* Select the fastest PIO mode that both the drive and the card can do.
+ * If the drive won't take it, it stays in its power-on mode (which is
+ * slower, so no harm done).
+ */
+static void     ide_set_pio(ide_host_t *ih, unsigned int drive)
+{
+        drive_info_t *di = &ih->drives[drive];
+        unsigned int mode = di->pio_max;
+        int r;
+
+        if (mode > ih->pio_max)
+                mode = ih->pio_max;
+
+        r = ide_nodata_command(ih, drive, WDCC_SET_FEATURES, WDSF_SET_MODE,
+                               WDSF_MODE_PIO | mode, IDE_TMO_MEDIUM);
+        if (r) {
+                DBG("ecide%d:%d: Set PIO%d failed, %04x\n", ih->card_num, drive, mode, r);
+                return;
+        }
+        di->pio_mode = mode;
+}
+
+/* Turn feature f (IDE_F_WCACHE etc.) on or off, as ih->features says, if
+ * the drive has it and it's not that way already.  SET FEATURES
+ * subcommands on/off do it.
+ */
+static unsigned int ide_feature_want(ide_host_t *ih, drive_info_t *di, unsigned int f)
+{
+        if (f == IDE_F_WCACHE && (di->quirks & IDE_Q_NOWCACHE))
+                return 0;
+        return ih->features & f;
+}
+
+static void     ide_set_feature(ide_host_t *ih, unsigned int drive, unsigned int f,
+                                unsigned int on, unsigned int off)
+{
+        drive_info_t *di = &ih->drives[drive];
+        unsigned int want = ide_feature_want(ih, di, f);
+        int r;
+
+        if (!(di->feat & f) || (di->feat_on & f) == want)
+                return;
+        r = ide_nodata_command(ih, drive, WDCC_SET_FEATURES, want ? on : off, 0,
+                               IDE_TMO_MEDIUM);
+        if (r) {
+                DBG("ecide%d:%d: SET FEATURES %02x failed, %04x\n", ih->card_num,
+                    drive, want ? on : off, r);
+                return;
+        }
+        di->feat_on = (di->feat_on & ~f) | want;
+}
+
+/* Apply the settings chosen for the drive: at init, and again after a
+ * reset, which may have put it back to its power-on settings.
+ */
+static void     ide_setup_drive(ide_host_t *ih, unsigned int drive)
+{
+        ide_set_multiple(ih, drive);
+        ide_set_pio(ih, drive);
+        ide_set_feature(ih, drive, IDE_F_WCACHE, WDSF_WCACHE_ON, WDSF_WCACHE_OFF);
+        ide_set_feature(ih, drive, IDE_F_LOOKAHEAD, WDSF_RLA_ON, WDSF_RLA_OFF);
+}
+
+/* Write back the drive's write cache, if it's on.  That can take a while
+ * (ATA allows 30s), so it gets IDE_TMO_LONG.  Drives with 48-bit addressing
+ * get the EXT command, which covers sectors past LBA28_LIMIT.  Returns 0
+ * for success, -1 on timeout, or status<<8 | error.
+ */
+int     ide_flush_cache(ide_host_t *ih, unsigned int drive)
+{
+        drive_info_t *di = &ih->drives[drive];
+
+        if (!(di->feat_on & IDE_F_WCACHE))
+                return 0;
+        return ide_nodata_command(ih, drive,
+                                  di->lba48 ? WDCC_FLUSH_CACHE_EXT : WDCC_FLUSH_CACHE,
+                                  0, 0, IDE_TMO_LONG);
+}
+
+/* After a data phase that might not have been read properly (e.g. probing
+ * bus timing), read out whatever the drive has left so it returns to idle.
+ * Uses ih->regs, which is assumed to be safe.
+ */
+void    ide_drain_data(ide_host_t *ih)
+{
+        int i;
+
+        for (i = 0; i < 256; i++) {
+                if (ide_wait_nbsy(ih, IDE_TMO_SHORT) ||
+                    !(read_reg8(ih->regs, wd_status) & WDCS_DRQ))
+                        return;
+                (void)read_reg16(ih->regs, wd_data);
+        }
+}
+
+/* Issue a command that moves one sector of PIO data, in or out (e.g.
+ * IDENTIFY, READ/WRITE BUFFER).
+ * Returns 0 for success, -1 on timeout, or status<<8 | error.
+ */
+static int      ide_pio_sector(ide_host_t *ih, unsigned int drive, unsigned int cmd,
+                               u8 *buf, int write)
+{
+        unsigned int s;
+        int r;
+
+        if (ide_select_wait(ih, drive))
+                return -1;
+
+        write_reg8(ih->regs, wd_command, cmd);
+
+        r = ide_wait_drq(ih, IDE_TMO_MEDIUM);
+        if (r != 0) {
+                ide_tf_invalidate(ih);
+                return r;
+        }
+        if (!write) {
+                ih->ops.read_sectors(ih, buf, 1);
+                return 0;
+        }
+        ih->ops.write_sectors(ih, buf, 1);
+        if (ide_wait_nbsy(ih, IDE_TMO_MEDIUM))
+                return -1;
+        s = read_reg8(ih->regs, wd_status);
+        if (s & (WDCS_ERR | WDCS_DRVFLT)) {
+                ide_tf_invalidate(ih);
+                return (s << 8) | read_reg8(ih->regs, wd_error);
+        }
+        return 0;
+}
+
+/* Issue IDENTIFY to a drive and read the 512 bytes it returns.
+ * Returns 0 for success, -1 on timeout, or status<<8 | error.
+ */
+int     ide_identify(ide_host_t *ih, unsigned int drive, u8 *buf)
+{
+        return ide_pio_sector(ih, drive, WDCC_IDENTIFY, buf, 0);
+}
+
+/* Read IDENTIFY data from drive and summarise it, for checking that the
+ * data path works (e.g. while probing bus timing).  Returns 0 on failure,
+ * otherwise a non-zero checksum.
+ */
+unsigned int ide_identify_sum(ide_host_t *ih, unsigned int drive, u8 *buf)
+{
+        unsigned int *p = (unsigned int *)buf;
+        unsigned int x = 0, s = 0;
+        int i;
+
+        if (ide_identify(ih, drive, buf) != 0) {
+                ide_drain_data(ih);
+                return 0;
+        }
+        /* The drive should have nothing left for us, unless the
+         * reads were bad:
+         */
+        if (read_reg8(ih->regs, wd_status) & WDCS_DRQ) {
+                ide_drain_data(ih);
+                return 0;
+        }
+        for (i = 0; i < D_SECSIZE/4; i++) {
+                x = ((x << 5) | (x >> 27)) ^ p[i];
+                s += p[i];
+        }
+        return (x ^ s) | 1;
+}
+
+/* See whether window decodes to the data register across 8 words (32
+ * bytes), so that data can be moved with LDM/STM bursts.  Reads are
+ * checked by comparing IDENTIFY data read through the window with that
+ * read normally.  Writes can only be checked without touching the medium
+ * if the drive has the (optional) WRITE/READ BUFFER commands, so the write
+ * window is only used if those round-trip a pattern.
+ *
+ * Sets ih->rd_window/wr_window, and the data ops to match; returns 1 for
+ * read, 2 for write bursts (ORed).  buf is a 512-byte scratch buffer.
+ */
+int     ide_probe_window(ide_host_t *ih, unsigned int drive, regs_t window, u8 *buf)
+{
+        unsigned int *p = (unsigned int *)buf;
+        u16 *id = (u16 *)buf;
+        unsigned int ref;
+        int i;
+
+        ih->rd_window = 0;
+        ih->wr_window = 0;
+        ide_set_data_ops(ih);
+        if (!window || ih->hi_latch_read || ih->hi_latch_write)
+                return 0;
+
+        ref = ide_identify_sum(ih, drive, buf);
+        if (!ref)
+                return 0;
+        ih->rd_window = window;
+        ide_set_data_ops(ih);
+        if (ide_identify_sum(ih, drive, buf) != ref ||
+            ide_identify_sum(ih, drive, buf) != ref) {
+                ih->rd_window = 0;
+                ide_set_data_ops(ih);
+                return 0;
+        }
+
+        /* buf holds the IDENTIFY data: */
+        if ((id[82] & 0x3000) != 0x3000 || id[82] == 0xffff)
+                return 1;
+
+        for (i = 0; i < D_SECSIZE/4; i++)
+                p[i] = (i * 0x01010101) ^ 0xa5c35a3c;
+        ih->wr_window = window;
+        ide_set_data_ops(ih);
+        if (ide_pio_sector(ih, drive, WDCC_WRITE_BUFFER, buf, 1) == 0 &&
+            ide_pio_sector(ih, drive, WDCC_READ_BUFFER, buf, 0) == 0) {
+                for (i = 0; i < D_SECSIZE/4; i++)
+                        if (p[i] != ((i * 0x01010101) ^ 0xa5c35a3c))
+                                break;
+                if (i == D_SECSIZE/4)
+                        return 3;
+        }
+        ide_drain_data(ih);
+        ih->wr_window = 0;
+        ide_set_data_ops(ih);
+        return 1;
 }
 
-/* Reset drives?
+/*
+ * Finding out which drives are there.
+ *
+ * IDENTIFY on a missing drive only fails when its waits time out, which
+ * takes seconds, so ide_init() first looks for the cheaper signs that
+ * there's nothing there:
+ *  - With no drive driving the bus, status floats to 0xff, or 0x7f where
+ *    the card pulls DD7 down as ATA asks;
+ *  - Drive 0 answers for a missing drive 1 with a status of 0;
+ *  - After a reset, a drive leaves its signature in the address registers
+ *    (1, 1, 0, 0 for ATA; ATAPI devices, which this driver can't use, leave
+ *    0x14, 0xeb in the cylinder registers);
+ *  - Otherwise, the taskfile registers must at least hold what's written;
+ *  - A busy drive can't show any of that, but answers reads of every
+ *    taskfile register with its status, so before waiting up to
+ *    IDE_TMO_LONG for it, check they all read as busy.  (A card that only
+ *    latches what's written, with nothing behind it, fails that.)
+ */
+static int      ide_floating(unsigned int s)
+{
+        return s == 0xff || s == 0x7f;
+}
+
+/* Status shows BSY: is that a drive?  Returns 1 if the taskfile reads as a
+ * busy drive's would, or the drive's ready now, else 0.
+ */
+static int      ide_busy_answers(ide_host_t *ih)
+{
+        unsigned int r, all = 0xff;
+
+        for (r = wd_error; r <= wd_sdh; r++)
+                all &= read_reg8(ih->regs, r);
+        return (all & WDCS_BUSY) || !(read_reg8(ih->regs, wd_status) & WDCS_BUSY);
+}
+
+/* Reset the drives with SRST, if the card decodes the control block, and
+ * wait for up to ms milliseconds for them to come back.
+ * Drives are left with their power-on settings (see ide_setup_drive()).
+ * Returns -1 if there's no control block, or drive 0 stays busy; else 0.
+ */
+int     ide_soft_reset(ide_host_t *ih, unsigned int ms)
+{
+        unsigned int s;
+
+        if (!ih->ctl_regs)
+                return -1;
+        write_reg8(ih->ctl_regs, wd_devctl, WDCTL_4BIT | WDCTL_RST);
+        DELAYUS(5);
+        write_reg8(ih->ctl_regs, wd_devctl, WDCTL_4BIT);
+        DELAYUS(2000);
+        ide_tf_invalidate(ih);
+
+        s = read_reg8(ih->regs, wd_status);
+        if (ide_floating(s))
+                return 0;                       /* Nothing to wait for */
+        if ((s & WDCS_BUSY) && !ide_busy_answers(ih))
+                return -1;                      /* Nor is this a drive */
+        return ide_poll_nbsy(ih, ms);
+}
+
+/* Get the drives back to a known state after a transfer has gone badly
+ * wrong (timed out, or lost track of the protocol): reset them, if the
+ * card can, and set them up again.  The drive's feature settings aren't
+ * known after the reset, so each is set explicitly.
+ * Returns -1 if the card can't reset the drives, or they didn't recover.
+ */
+int     ide_recover(ide_host_t *ih)
+{
+        drive_info_t *di;
+        unsigned int i;
+
+        if (ide_soft_reset(ih, IDE_TMO_MEDIUM))     /* Already spinning */
+                return -1;
+        for (i = 0; i < 2; i++) {
+                di = &ih->drives[i];
+                if (!di->present)
+                        continue;
+                di->feat_on = di->feat &
+                        ~(ide_feature_want(ih, di, IDE_F_WCACHE) |
+                          ide_feature_want(ih, di, IDE_F_LOOKAHEAD));
+                ide_setup_drive(ih, i);
+        }
+        return 0;
+}
+
+/* Returns 0 if the drive is certainly absent, else 1.  With reset set,
+ * the drives have just been reset, so signatures can be believed.
+ */
+static int      ide_probe_drive(ide_host_t *ih, unsigned int drive, int reset)
+{
+        unsigned int s, mid, hi;
+
+        ide_select_drive(ih, drive);
+        (void)read_reg8(ih->regs, wd_status);
+        (void)read_reg8(ih->regs, wd_status);
+        (void)read_reg8(ih->regs, wd_status);
+        s = read_reg8(ih->regs, wd_status);
+
+        if (ide_floating(s))
+                return 0;
+        if (drive == 1 && s == 0)
+                return 0;
+        if (s & WDCS_BUSY)                      /* Still coming out of reset? */
+                return ide_busy_answers(ih);
+        if (reset) {
+                mid = read_reg8(ih->regs, wd_cyl_lo);
+                hi = read_reg8(ih->regs, wd_cyl_hi);
+                if (mid == WDSIG_ATAPI_MID && hi == WDSIG_ATAPI_HI) {
+                        DBG("ide_init: drive %d is ATAPI, ignored\n", drive);
+                        return 0;
+                }
+                if (mid == 0 && hi == 0 &&
+                    read_reg8(ih->regs, wd_seccnt) == 1 &&
+                    read_reg8(ih->regs, wd_sector) == 1)
+                        return 1;
+        }
+        ih->tf_valid &= ~((1 << wd_seccnt) | (1 << wd_sector));
+        write_reg8(ih->regs, wd_seccnt, 0x55);
+        write_reg8(ih->regs, wd_sector, 0xaa);
+        return read_reg8(ih->regs, wd_seccnt) == 0x55 &&
+                read_reg8(ih->regs, wd_sector) == 0xaa;
+}
+
+/* Reset drives (where the card can)
  * Identify devices
  */
 int     ide_init(ide_host_t *ih, int card, u8 *scratch_buffer)
 {
-        int i;
+        int i, reset;
         int td = 0;
 
+        if (!ih->data_regs)
+                ih->data_regs = ih->regs;
+        if (!ih->ops.read_sectors || !ih->ops.write_sectors)
+                ide_set_data_ops(ih);
+        if (!ih->ops.setup_address)
+                ih->ops.setup_address = ide_setup_address;
+        ide_tf_invalidate(ih);
+
         /* Can regs be accessed? */
         write_reg8(ih->regs, wd_cyl_lo, 0xaa);
         write_reg8(ih->regs, wd_cyl_hi, 0x55);
@@ -249,134 +1048,489 @@ int     ide_init(ide_host_t *ih, int card, u8 *scratch_buffer)
                 DBG("ide_init: Can't access regs\n");
                 return -1;
         }
+        ide_calibrate(ih);
         /* Now want to probe whether drive 0/1 are present. */
+        reset = ide_soft_reset(ih, IDE_TMO_LONG) == 0;
 
         /* OK, do an IDENTIFY on each drive: */
         for (i = 0; i < 2; i++) {
                 int r;
                 ih->drives[i].present = 0;
                 ih->drives[i].lba_supported = 0;
+                ih->drives[i].lba48 = 0;
                 ih->drives[i].total_sectors = 0;
                 ih->drives[i].cyl = 0;
                 ih->drives[i].heads = 0;
                 ih->drives[i].sec_per_track = 0;
+                ih->drives[i].spc = 0;
+                ih->drives[i].multi_max = 0;
+                ih->drives[i].multi = 0;
+                ih->drives[i].pio_max = 0;
+                ih->drives[i].pio_mode = 0;
+                ih->drives[i].feat = 0;
+                ih->drives[i].feat_on = 0;
+                ih->drives[i].quirks = 0;
+                ih->drives[i].max_sectors = 0;
+                ih->drives[i].settle_us = 0;
+                ih->drives[i].wait_est = 0;
+                ih->drives[i].wait_n = 0;
 
-                ide_select_drive(ih, i);
-                r = ide_wait_nbsy(ih->regs);
-                if (r) {
-                        DBG("ide_init: Timeout on nbusy for drive %d\n", i);
+                if (!ide_probe_drive(ih, i, reset)) {
+                        DBG("ide_init: No drive %d\n", i);
                         continue;
                 }
-
-                write_reg8(ih->regs, wd_command, WDCC_IDENTIFY);
-
-                r = ide_wait_drq(ih->regs);
+                /* It may still be spinning up */
+                if (ide_poll_nbsy(ih, IDE_TMO_LONG)) {
+                        DBG("ide_init: Drive %d stays busy\n", i);
+                        continue;
+                }
+                r = ide_identify(ih, i, scratch_buffer);
                 if (r != 0) {
                         if (r < 0)
-                                DBG("ide_init: Timeout on DRQ for IDENTITY on drive %d\n", i);
+                                DBG("ide_init: Timeout for IDENTITY on drive %d\n", i);
                         else
                                 DBG("ide_init: Error for IDENTITY on drive %d: %04x\n", i, r);
                         continue;
                 }
                 ih->drives[i].present = 1;
                 td++;
-                if (!ih->hi_latch_read)
-                        ide_read_data(ih->regs, scratch_buffer);
-                else
-                        ide_read_data8(ih->regs, ih->hi_latch_read, scratch_buffer);
 
                 ide_parse_identify((u16 *)scratch_buffer, &ih->drives[i], card);
+                ide_setup_drive(ih, i);
+                printf("ecide%d:%d: PIO%d (drive max %d), %d sectors/block%s%s\n",
+                       card, i, ih->drives[i].pio_mode, ih->drives[i].pio_max,
+                       ih->drives[i].multi ? ih->drives[i].multi : 1,
+                       (ih->drives[i].feat_on & IDE_F_WCACHE) ? ", write cache" : "",
+                       (ih->drives[i].feat_on & IDE_F_LOOKAHEAD) ? ", look-ahead" : "");
         }
 
         return td;
 }
 
-static void     ide_setup_address(ide_host_t *ih, unsigned int drive, unsigned int sector)
+/* Program the sector count and address registers for the next command of
+ * x (x->cmd_left sectors from x->sector).  For 48-bit commands, each
+ * register is a two-deep FIFO, so the high-order bytes go in first.  A
+ * count of 0 means 256, or 65536 for EXT.
+ */
+void    ide_setup_address(ide_host_t *ih, ide_xfer_t *x)
 {
-        /* Calculate address... */
-        if (ih->drives[drive].lba_supported) {
+        unsigned int drive = x->drive;
+        unsigned int sector = x->sector;
+        unsigned int count = x->cmd_left;
+
+        if (x->ext) {
+                /* Both FIFO stages must be written, so no shadowing */
+                write_reg8(ih->regs, wd_seccnt, (count >> 8) & 0xff);
+                write_reg8(ih->regs, wd_lba_lo, (sector >> 24) & 0xff);
+                write_reg8(ih->regs, wd_lba_mid, 0);
+                write_reg8(ih->regs, wd_lba_hi, 0);
+                write_reg8(ih->regs, wd_seccnt, count & 0xff);
                 write_reg8(ih->regs, wd_lba_lo, sector & 0xff);
                 write_reg8(ih->regs, wd_lba_mid, (sector >> 8) & 0xff);
                 write_reg8(ih->regs, wd_lba_hi, (sector >> 16) & 0xff);
-                write_reg8(ih->regs, wd_sdh, DRVBLK_LBA(drive, sector >> 24));
+                write_reg8(ih->regs, wd_sdh, DRVBLK_LBA(drive, 0));
+                ih->tf_valid &= ~(TF_ADDR | (1 << wd_seccnt));
+                return;
+        }
+
+        ide_tf_write(ih, wd_seccnt, count & 0xff);
+        /* Calculate address... */
+        if (ih->drives[drive].lba_supported) {
+                ide_tf_write(ih, wd_lba_lo, sector & 0xff);
+                ide_tf_write(ih, wd_lba_mid, (sector >> 8) & 0xff);
+                ide_tf_write(ih, wd_lba_hi, (sector >> 16) & 0xff);
+                ide_tf_write(ih, wd_sdh, DRVBLK_LBA(drive, sector >> 24));
         } else {
-                unsigned int s = (sector % ih->drives[drive].sec_per_track) + 1;
-                unsigned int c = (sector / ih->drives[drive].sec_per_track) / ih->drives[drive].heads;
-                unsigned int h = (sector / ih->drives[drive].sec_per_track) % ih->drives[drive].heads;
                 /* NOTE: Sector starts at one! */
-                write_reg8(ih->regs, wd_sector, s);
-                write_reg8(ih->regs, wd_cyl_lo, c & 0xff);
-                write_reg8(ih->regs, wd_cyl_hi, (c >> 8) & 0xff);
-                write_reg8(ih->regs, wd_sdh, DRVHD(drive, h));
+                ide_tf_write(ih, wd_sector, x->sect + 1);
+                ide_tf_write(ih, wd_cyl_lo, x->cyl & 0xff);
+                ide_tf_write(ih, wd_cyl_hi, (x->cyl >> 8) & 0xff);
+                ide_tf_write(ih, wd_sdh, DRVHD(drive, x->head));
         }
 }
 
-#define SECTOR_LIMIT    128     /* Quirks? Standard? */
-/* Read sectors, without IRQs.  Returns 0 for success, else error code.
+/* Set up the CHS cursor for x->sector; there's no divide instruction, so
+ * this is done once per transfer and then moved along by ide_chs_advance().
  */
-int     ide_read_some(ide_host_t *ih, unsigned int drive,
-                      unsigned int sector, unsigned int count,
-                      unsigned char *dest)
+static void     ide_chs_seek(ide_host_t *ih, ide_xfer_t *x)
+{
+        drive_info_t *di = &ih->drives[x->drive];
+        unsigned int r;
+
+        x->cyl = x->sector / di->spc;
+        r = x->sector - x->cyl * di->spc;
+        x->head = r / di->sec_per_track;
+        x->sect = r - x->head * di->sec_per_track;
+}
+
+static void     ide_chs_advance(ide_host_t *ih, ide_xfer_t *x, unsigned int n)
+{
+        drive_info_t *di = &ih->drives[x->drive];
+
+        x->sect += n;
+        while (x->sect >= di->sec_per_track) {
+                x->sect -= di->sec_per_track;
+                if (++x->head == di->heads) {
+                        x->head = 0;
+                        x->cyl++;
+                }
+        }
+}
+
+/* Most sectors per command, unless ide_quirks[] says otherwise.  ATA
+ * allows 256 (65536 for EXT), but some older devices mishandle more than
+ * 128.
+ */
+#define SECTOR_LIMIT    128
+#define SECTOR_LIMIT_EXT 65536
+#define LBA28_LIMIT     0x10000000
+
+/* Move one DRQ block (x->block sectors, or what's left of the command),
+ * which might span memory segments.
+ */
+static void     ide_xfer_block(ide_host_t *ih, ide_xfer_t *x)
+{
+        unsigned int n = x->block;
+        unsigned int m, left;
+
+        if (n > x->cmd_left)
+                n = x->cmd_left;
+
+        for (left = n; left > 0; left -= m) {
+                while (x->seg_left == 0 && x->seg + 1 < x->nsegs) {
+                        x->seg++;
+                        x->addr = x->segs[x->seg].addr;
+                        x->seg_left = x->segs[x->seg].count;
+                }
+                m = left < x->seg_left ? left : x->seg_left;
+                if (x->write)
+                        ih->ops.write_sectors(ih, x->addr, m);
+                else
+                        ih->ops.read_sectors(ih, x->addr, m);
+                x->addr += m * D_SECSIZE;
+                x->seg_left -= m;
+        }
+        if (!ih->drives[x->drive].lba_supported)
+                ide_chs_advance(ih, x, n);
+        x->sector += n;
+        x->count -= n;
+        x->cmd_left -= n;
+        if (x->write)
+                x->pending = n;
+}
+
+/* Issue the command for the next chunk of a transfer (up to SECTOR_LIMIT
+ * sectors, or the drive's max_sectors).  For a write, the device asks for the first block without
+ * raising an interrupt, so that's sent here too; subsequent blocks are moved
+ * by ide_xfer_service().
+ *
+ * Returns IDE_XFER_MORE if the command is underway, else IDE_XFER_ERROR.
+ */
+static int      ide_xfer_command(ide_host_t *ih, ide_xfer_t *x)
 {
+        drive_info_t *di = &ih->drives[x->drive];
         int r;
-        unsigned int done_sectors;
-        unsigned int sectors_this_time;
-        unsigned int s;
+        unsigned int cmd;
 
-        ide_select_drive(ih, drive);
-        if (ide_wait_nbsy(ih->regs)) {
-                DBG("ide_read_some: Timeout on nBSY\n");
-                return 1;
+        if (ide_select_wait(ih, x->drive)) {
+                DBG("ide_xfer_command: Timeout on nBSY\n");
+                x->error = -1;
+                return IDE_XFER_ERROR;
         }
 
-        write_reg8(ih->regs, wd_precomp, 0);
+        /* Use a 48-bit command if the run is long enough to benefit, or if it
+         * needs the address bits.  Otherwise, the regular command takes
+         * fewer register writes.
+         */
+        x->ext = di->lba48 && (x->sector + x->count > LBA28_LIMIT ||
+                               (!di->max_sectors && x->count > SECTOR_LIMIT));
+        x->cmd_left = x->ext ? SECTOR_LIMIT_EXT : SECTOR_LIMIT;
+        if (di->max_sectors) {
+                x->cmd_left = di->max_sectors;
+                if (!x->ext && x->cmd_left > 256)
+                        x->cmd_left = 256;
+        }
+        if (x->count < x->cmd_left)
+                x->cmd_left = x->count;
 
 #ifdef SUPER_VERBOSE
-        DBG("ide_read_some(sector %d, count %d)\n", sector, count);
+        DBG("   ide_xfer_command(%s sector %d, sectorcount %d%s)\n",
+            x->write ? "WR" : "RD", x->sector, x->cmd_left, x->ext ? ", EXT" : "");
 #endif
-        done_sectors = 0;
-        do {
-                /* How many sectors are left? */
-                if ((count - done_sectors) > SECTOR_LIMIT)
-                        sectors_this_time = SECTOR_LIMIT;
+        ide_tf_write(ih, wd_precomp, 0);
+        ih->ops.setup_address(ih, x);
+        if (ih->drives[x->drive].multi) {
+                x->block = ih->drives[x->drive].multi;
+                if (x->ext)
+                        cmd = x->write ? WDCC_WRITE_MULTI_EXT : WDCC_READ_MULTI_EXT;
+                else
+                        cmd = x->write ? WDCC_WRITE_MULTI : WDCC_READ_MULTI;
+        } else {
+                x->block = 1;
+                if (x->ext)
+                        cmd = x->write ? WDCC_WRITE_EXT : WDCC_READ_EXT;
                 else
-                        sectors_this_time = count - done_sectors;
+                        cmd = x->write ? WDCC_WRITE : WDCC_READ;
+        }
+        /* CompactFlash can skip erasing sectors that already are */
+        if (x->write && x->noerase && !x->ext)
+                cmd = x->block > 1 ? WDCC_CFA_WRITE_MULTI_NE : WDCC_CFA_WRITE_NE;
+        write_reg8(ih->regs, wd_command, cmd);
+        x->first = 1;
 
-#ifdef SUPER_VERBOSE
-                DBG("   ide_read_some(sector %d, sectorcount %d)\n",
-                    sector + done_sectors,
-                    sectors_this_time);
-#endif
-                write_reg8(ih->regs, wd_seccnt, sectors_this_time);
-                ide_setup_address(ih, drive, sector + done_sectors);
-                write_reg8(ih->regs, wd_command, WDCC_READ);
-
-                for (s = 0; s < sectors_this_time; s++) {
-                        r = ide_wait_drq(ih->regs);
-                        if (r != 0) {
-                                if (r < 0)
-                                        DBG("ide_read_some: Timeout on DRQ\n");
-                                else
-                                        DBG("ide_read_some: Error %04x\n", r);
-                                return 1;
+        if (!x->write)
+                return IDE_XFER_MORE;
+
+        r = ide_wait_drq(ih, ide_xfer_tmo(x));
+        if (r != 0) {
+                if (r < 0)
+                        DBG("ide_xfer_command: Timeout on write DRQ\n");
+                else
+                        DBG("ide_xfer_command: Error %04x\n", r);
+                x->error = r;
+                ide_tf_invalidate(ih);
+                return IDE_XFER_ERROR;
+        }
+        ide_xfer_block(ih, x);
+        return IDE_XFER_MORE;
+}
+
+/* Start a transfer described by x (drive, sector, count, write, and addr
+ * or nsegs/segs).
+ * Returns IDE_XFER_MORE if ide_xfer_service() should be called when the
+ * device next interrupts (or is seen to be not busy), IDE_XFER_DONE for an
+ * empty transfer, or IDE_XFER_ERROR.
+ */
+int     ide_xfer_start(ide_host_t *ih, ide_xfer_t *x)
+{
+        x->error = 0;
+        x->cmd_left = 0;
+        x->pending = 0;
+        x->first = 0;
+        x->seg = 0;
+        if (x->nsegs) {
+                x->addr = x->segs[0].addr;
+                x->seg_left = x->segs[0].count;
+        } else {
+                x->seg_left = x->count;
+        }
+        if (x->count == 0)
+                return IDE_XFER_DONE;
+        if (!ih->drives[x->drive].lba_supported)
+                ide_chs_seek(ih, x);
+        return ide_xfer_command(ih, x);
+}
+
+/* Advance a transfer: called from the IRQ handler, or when polling has seen
+ * !BSY.  Reading status here also clears the device's INTRQ.
+ *
+ * Reads get an interrupt per block when the data is ready; writes get one
+ * per block when the device has swallowed the previous one, plus one at the
+ * end of the command.
+ */
+int     ide_xfer_service(ide_host_t *ih, ide_xfer_t *x)
+{
+        unsigned int s = read_reg8(ih->regs, wd_status);
+
+        if (s & WDCS_BUSY)
+                return IDE_XFER_MORE;           /* Not for us (yet) */
+        x->first = 0;
+
+        if ((s & WDCS_ERR) || (s & WDCS_DRVFLT)) {
+                x->error = (s << 8) | read_reg8(ih->regs, wd_error);
+                DBG("ide_xfer_service: Error %04x at sector %d\n", x->error, x->sector);
+                ide_tf_invalidate(ih);
+                return IDE_XFER_ERROR;
+        }
+        x->pending = 0;                 /* The drive took the last block */
+
+        if (!x->write || x->cmd_left != 0) {
+                if (!(s & WDCS_DRQ)) {
+                        DBG("ide_xfer_service: No DRQ (status %02x)\n", s);
+                        x->error = s << 8;
+                        ide_tf_invalidate(ih);
+                        return IDE_XFER_ERROR;
+                }
+                ide_xfer_block(ih, x);
+                /* A write's last block still has a completion IRQ to come */
+                if (x->write || x->cmd_left != 0)
+                        return IDE_XFER_MORE;
+        }
+
+        /* End of command */
+        ide_tf_cmd_done(ih, x->drive, x->sector - 1,
+                        !x->ext && ih->drives[x->drive].lba_supported);
+        if (x->count == 0)
+                return IDE_XFER_DONE;
+        return ide_xfer_command(ih, x);
+}
+
+/* A plain error from the drive (e.g. a marginal sector) can just be
+ * retried, but after a timeout, fault or protocol muddle the drives need
+ * resetting first (see ide_recover()).  Non-zero if x's failure needs that.
+ */
+int     ide_xfer_wants_reset(ide_xfer_t *x)
+{
+        return x->error < 0 ||
+                (x->error & ((WDCS_ERR | WDCS_DRVFLT) << 8)) != (WDCS_ERR << 8);
+}
+
+/* Try a failed transfer again, from the first sector that didn't make it:
+ * for a read, the block that failed; for a write, the block the drive
+ * hadn't yet accepted (x->pending sectors back), which may span segments.
+ * The caller resets the drives first if ide_xfer_wants_reset() says so.
+ * Returns as ide_xfer_start().
+ */
+int     ide_xfer_retry(ide_host_t *ih, ide_xfer_t *x)
+{
+        unsigned int back = x->pending;
+        unsigned int used, m;
+
+        ide_tf_invalidate(ih);
+
+        x->sector -= back;
+        x->count += back;
+        if (x->nsegs == 0) {
+                x->addr -= back * D_SECSIZE;
+                x->seg_left += back;
+        } else {
+                while (back > 0) {
+                        used = x->segs[x->seg].count - x->seg_left;
+                        if (used == 0) {
+                                x->seg--;
+                                x->addr = x->segs[x->seg].addr +
+                                        x->segs[x->seg].count * D_SECSIZE;
+                                x->seg_left = 0;
+                                continue;
                         }
-                        if (!ih->hi_latch_read)
-                                ide_read_data(ih->regs, dest + ((done_sectors + s) * 512));
-                        else
-                                ide_read_data8(ih->regs, ih->hi_latch_read,
-                                               dest + ((done_sectors + s) * 512));
-                        /* Loop and wait for DRQ between each sector! */
+                        m = back < used ? back : used;
+                        x->addr -= m * D_SECSIZE;
+                        x->seg_left += m;
+                        back -= m;
                 }
-                if (ide_wait_nbsy(ih->regs)) {
-                        DBG("ide_read_some: Timeout on post-block nBSY\n");
+        }
+        if (x->count == 0)
+                return IDE_XFER_ERROR;  /* Failed after everything moved */
+        x->error = 0;
+        x->cmd_left = 0;
+        x->pending = 0;
+        /* The failed write may have programmed some of the erased
+         * sectors, so it's sent again as an ordinary write.
+         */
+        x->noerase = 0;
+        if (!ih->drives[x->drive].lba_supported)
+                ide_chs_seek(ih, x);
+        return ide_xfer_command(ih, x);
+}
+
+/* For polling without waiting: non-zero if the device is still busy with
+ * the current command or block.  Status can lag a command by 400ns, so the
+ * first reads are discarded as in ide_wait_nbsy().
+ */
+int     ide_xfer_busy(ide_host_t *ih)
+{
+        (void)read_reg8(ih->regs, wd_status);
+        (void)read_reg8(ih->regs, wd_status);
+        (void)read_reg8(ih->regs, wd_status);
+        return (read_reg8(ih->regs, wd_status) & WDCS_BUSY) != 0;
+}
+
+/* For background polling: wait for the device to finish with x's current
+ * command or block, but only for about as long as the drive usually takes:
+ * twice its wait_est, at least IDE_SPIN_MIN, or just that if the drive
+ * usually seeks (see ide_wait()).  So the short BSY between DRQ blocks is
+ * spun through rather than costing the caller a clock tick each time,
+ * while a seek is left to the next tick.  Every eighth call spins the full
+ * IDE_SPIN_MAX, to keep the estimate honest.  Non-zero if the device is
+ * ready for ide_xfer_service().
+ */
+int     ide_xfer_ready(ide_host_t *ih, ide_xfer_t *x)
+{
+        drive_info_t *di = &ih->drives[x->drive];
+        unsigned int us = di->wait_est * 2;
+        unsigned int spin, t;
+
+        if (!ide_xfer_busy(ih))
+                return 1;
+        if ((++di->wait_n & 7) == 0)
+                us = IDE_SPIN_MAX;
+        else if (di->wait_est > IDE_SPIN_MAX/2 || us < IDE_SPIN_MIN)
+                us = IDE_SPIN_MIN;
+        spin = IDE_LOOPS(ih, us);
+        for (t = 1; t <= spin; t++) {
+                DELAYUS(1);
+                if (!(read_reg8(ih->regs, wd_status) & WDCS_BUSY)) {
+                        ide_wait_sample(ih, di, t);
                         return 1;
                 }
-                done_sectors += sectors_this_time;
-        } while(done_sectors < count);
-
+        }
+        if (us == IDE_SPIN_MAX)
+                ide_wait_sample(ih, di, IDE_LOOPS(ih, IDE_SPIN_MAX*2));
         return 0;
 }
 
+/* How long (ms) to wait for the drive to move x on: a command's first
+ * block may have to wait for the drive to spin up from standby, so gets
+ * IDE_TMO_LONG; later blocks IDE_TMO_MEDIUM.
+ */
+unsigned int ide_xfer_tmo(ide_xfer_t *x)
+{
+        return x->first ? IDE_TMO_LONG : IDE_TMO_MEDIUM;
+}
+
+/* Run a transfer to completion by polling, retrying up to
+ * IDE_XFER_RETRIES times from where it fails.  A failure that needs the
+ * drives reset first is final if ide_recover() can't.  Returns
+ * IDE_XFER_DONE or IDE_XFER_ERROR.
+ */
+int     ide_xfer_polled(ide_host_t *ih, ide_xfer_t *x)
+{
+        unsigned int tries = 0;
+        int r;
+
+        r = ide_xfer_start(ih, x);
+        for (;;) {
+                while (r == IDE_XFER_MORE) {
+                        if (ide_wait_nbsy(ih, ide_xfer_tmo(x))) {
+                                DBG("ide_xfer_polled: Timeout on nBSY\n");
+                                x->error = -1;
+                                ide_tf_invalidate(ih);
+                                r = IDE_XFER_ERROR;
+                                break;
+                        }
+                        r = ide_xfer_service(ih, x);
+                }
+                if (r != IDE_XFER_ERROR || tries++ == IDE_XFER_RETRIES)
+                        return r;
+                DBG("ide_xfer_polled: Error %04x at sector %d, retrying\n",
+                    x->error, x->sector - x->pending);
+                if (ide_xfer_wants_reset(x) && ide_recover(ih))
+                        return IDE_XFER_ERROR;  /* Can't, or didn't help */
+                r = ide_xfer_retry(ih, x);
+        }
+}
+
+/* Read sectors, without IRQs.  Returns 0 for success, else error code.
+ */
+int     ide_read_some(ide_host_t *ih, unsigned int drive,
+                      unsigned int sector, unsigned int count,
+                      unsigned char *dest)
+{
+        ide_xfer_t x;
+
+#ifdef SUPER_VERBOSE
+        DBG("ide_read_some(sector %d, count %d)\n", sector, count);
+#endif
+        x.drive = drive;
+        x.sector = sector;
+        x.count = count;
+        x.addr = dest;
+        x.nsegs = 0;
+        x.write = 0;
+        x.noerase = 0;
+        return ide_xfer_polled(ih, &x) == IDE_XFER_DONE ? 0 : 1;
+}
+
 int     ide_read_one(ide_host_t *ih, unsigned int drive,
                      unsigned int sector, unsigned char *dest)
 {
@@ -387,61 +1541,19 @@ int     ide_write_some(ide_host_t *ih, unsigned int drive,
                        unsigned int sector, unsigned int count,
                        unsigned char *src)
 {
-        int r;
-        unsigned int done_sectors;
-        unsigned int sectors_this_time;
-        unsigned int s;
-
-        ide_select_drive(ih, drive);
-        if (ide_wait_nbsy(ih->regs)) {
-                DBG("ide_write_some: Timeout on nbusy\n");
-                return 1;
-        }
-
-        write_reg8(ih->regs, wd_precomp, 0);
+        ide_xfer_t x;
 
 #ifdef SUPER_VERBOSE
         DBG("ide_write_some(sector %d, count %d)\n", sector, count);
 #endif
-        done_sectors = 0;
-        do {
-                /* How many sectors are left? */
-                if ((count - done_sectors) > SECTOR_LIMIT)
-                        sectors_this_time = SECTOR_LIMIT;
-                else
-                        sectors_this_time = count - done_sectors;
-#ifdef SUPER_VERBOSE
-                DBG("   ide_write_some(sector %d, sectorcount %d)\n",
-                    sector + done_sectors,
-                    sectors_this_time);
-#endif
-                write_reg8(ih->regs, wd_seccnt, sectors_this_time);
-                ide_setup_address(ih, drive, sector + done_sectors);
-                write_reg8(ih->regs, wd_command, WDCC_WRITE);
-
-                for (s = 0; s < sectors_this_time; s++) {
-                        r = ide_wait_drq(ih->regs);
-                        if (r != 0) {
-                                if (r < 0)
-                                        DBG("ide_write_some: Timeout on DRQ\n");
-                                else
-                                        DBG("ide_write_some: Error %04x\n", r);
-                                return 1;
-                        }
-                        if (!ih->hi_latch_write)
-                                ide_write_data(ih->regs, src + ((done_sectors + s) * 512));
-                        else
-                                ide_write_data8(ih->regs, ih->hi_latch_write,
-                                                src + ((done_sectors + s) * 512));
-                }
-                if (ide_wait_nbsy(ih->regs)) {
-                        DBG("ide_write_some: Timeout on post-block nBSY\n");
-                        return 1;
-                }
-                done_sectors += sectors_this_time;
-        } while(done_sectors < count);
-
-        return 0;
+        x.drive = drive;
+        x.sector = sector;
+        x.count = count;
+        x.addr = src;
+        x.nsegs = 0;
+        x.write = 1;
+        x.noerase = 0;
+        return ide_xfer_polled(ih, &x) == IDE_XFER_DONE ? 0 : 1;
 }
 
 int     ide_write_one(ide_host_t *ih, unsigned int drive,
@@ -449,3 +1561,109 @@ int     ide_write_one(ide_host_t *ih, unsigned int drive,
 {
         return ide_write_some(ih, drive, sector, 1, src);
 }
+
+
+/* CFA erased extents: regions erased by ide_cfa_erase() and not written
+ * since, so writes there can skip the erase.  It's only a hint, so if the
+ * table's full the smallest extent is forgotten.
+ */
+static void     ide_erased_remove(drive_info_t *di, unsigned int i)
+{
+        di->erased[i] = di->erased[--di->nerased];
+}
+
+void    ide_erased_add(drive_info_t *di, unsigned int start, unsigned int count)
+{
+        unsigned int end = start + count;
+        unsigned int i, small;
+
+        /* Absorb those it overlaps or touches */
+        for (i = 0; i < di->nerased; ) {
+                if (di->erased[i].start > end || di->erased[i].end < start) {
+                        i++;
+                        continue;
+                }
+                if (di->erased[i].start < start)
+                        start = di->erased[i].start;
+                if (di->erased[i].end > end)
+                        end = di->erased[i].end;
+                ide_erased_remove(di, i);
+        }
+        if (di->nerased == IDE_ERASED_MAX) {
+                for (small = 0, i = 1; i < di->nerased; i++) {
+                        if (di->erased[i].end - di->erased[i].start <
+                            di->erased[small].end - di->erased[small].start)
+                                small = i;
+                }
+                if (di->erased[small].end - di->erased[small].start >= end - start)
+                        return;
+                ide_erased_remove(di, small);
+        }
+        di->erased[di->nerased].start = start;
+        di->erased[di->nerased].end = end;
+        di->nerased++;
+}
+
+/* A write of count sectors from start is about to be issued: returns 1 if
+ * they're all erased, so the write needn't erase them.  Either way, they
+ * aren't erased afterwards.
+ */
+int     ide_erased_take(drive_info_t *di, unsigned int start, unsigned int count)
+{
+        unsigned int end = start + count;
+        unsigned int i, s, e;
+        int all = 0;
+
+        for (i = 0; i < di->nerased; ) {
+                s = di->erased[i].start;
+                e = di->erased[i].end;
+                if (s >= end || e <= start) {
+                        i++;
+                        continue;
+                }
+                if (s <= start && e >= end)
+                        all = 1;
+                ide_erased_remove(di, i);
+                /* Keep what's either side */
+                if (s < start)
+                        ide_erased_add(di, s, start - s);
+                if (e > end)
+                        ide_erased_add(di, end, e - end);
+        }
+        return all;
+}
+
+/* CFA ERASE SECTORS, up to 256 at a time, recording what's erased.  Erasing
+ * takes a while, so each command gets IDE_TMO_LONG.  28-bit addresses only.
+ * Returns 0 for success, -1 on timeout, or status<<8 | error.
+ */
+int     ide_cfa_erase(ide_host_t *ih, unsigned int drive, unsigned int sector,
+                      unsigned int count)
+{
+        drive_info_t *di = &ih->drives[drive];
+        ide_xfer_t x;
+        int r;
+
+        if (!(di->feat & IDE_F_CFA) || sector + count > LBA28_LIMIT)
+                return -1;
+        x.drive = drive;
+        x.ext = 0;
+        while (count > 0) {
+                x.sector = sector;
+                x.cmd_left = count < 256 ? count : 256;
+                if (!di->lba_supported)
+                        ide_chs_seek(ih, &x);
+                if (ide_select_wait(ih, drive))
+                        return -1;
+                ih->ops.setup_address(ih, &x);
+                write_reg8(ih->regs, wd_command, WDCC_CFA_ERASE);
+                ih->tf_valid &= ~(TF_ADDR | (1 << wd_seccnt));
+                r = ide_nodata_wait(ih, IDE_TMO_LONG);
+                if (r)
+                        return r;
+                ide_erased_add(di, sector, x.cmd_left);
+                sector += x.cmd_left;
+                count -= x.cmd_left;
+        }
+        return 0;
+}
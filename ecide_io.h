@@ -24,7 +24,48 @@
 
 #include "ecide.h"
 
+/* ide_xfer_start()/ide_xfer_service() return codes */
+#define IDE_XFER_MORE   0
+#define IDE_XFER_DONE   1
+#define IDE_XFER_ERROR  2
+
+/* Timeout classes (ms), for ide_wait_nbsy() etc.: register settle and
+ * drive select; a data block or non-data command; spin-up, reset, cache
+ * flush or erase.
+ */
+#define IDE_TMO_SHORT   100
+#define IDE_TMO_MEDIUM  2000
+#define IDE_TMO_LONG    31000
+
+/* Times a failed transfer is tried again (see ide_xfer_retry()) */
+#define IDE_XFER_RETRIES 2
+
+/*
+ * Devices that need settings other than the defaults, or can safely go
+ * beyond them, matched on prefixes of the IDENTIFY model and firmware
+ * strings (a null firmware prefix matches any).  Zero max_sectors and
+ * settle_us keep the default; pio_max is IDE_PIO_ANY for no limit.  Tables
+ * end with a null model.
+ */
+#define IDE_PIO_ANY     (-1)
+
+typedef struct {
+        const char      *model;
+        const char      *fw;
+        unsigned int    quirks;         /* IDE_Q_ */
+        unsigned int    max_sectors;    /* Most sectors per command */
+        int             pio_max;        /* Fastest safe PIO mode */
+        unsigned int    settle_us;      /* Extra delay before each command */
+} ide_quirk_t;
+
+#ifdef ECIDE_SIM
+/* Use table instead of the built-in quirks, or those again if 0 */
+void    ide_set_quirks(const ide_quirk_t *table);
+#endif
+
 int     ide_init(ide_host_t *ih, int card, u8 *scratch_buffer);
+int     ide_soft_reset(ide_host_t *ih, unsigned int waits);
+int     ide_recover(ide_host_t *ih);
 int     ide_read_one(ide_host_t *ih, unsigned int drive,
                      unsigned int sector, unsigned char *dest);
 int     ide_write_one(ide_host_t *ih, unsigned int drive,
@@ -35,5 +76,39 @@ int     ide_read_some(ide_host_t *ih, unsigned int drive,
 int     ide_write_some(ide_host_t *ih, unsigned int drive,
                        unsigned int sector, unsigned int count,
                        unsigned char *src);
+void    ide_set_data_ops(ide_host_t *ih);
+void    ide_tf_invalidate(ide_host_t *ih);
+void    ide_setup_address(ide_host_t *ih, ide_xfer_t *x);
+int     ide_identify(ide_host_t *ih, unsigned int drive, u8 *buf);
+unsigned int ide_identify_sum(ide_host_t *ih, unsigned int drive, u8 *buf);
+int     ide_probe_window(ide_host_t *ih, unsigned int drive, regs_t window, u8 *buf);
+void    ide_drain_data(ide_host_t *ih);
+int     ide_flush_cache(ide_host_t *ih, unsigned int drive);
+int     ide_cfa_erase(ide_host_t *ih, unsigned int drive, unsigned int sector,
+                      unsigned int count);
+void    ide_erased_add(drive_info_t *di, unsigned int start, unsigned int count);
+int     ide_erased_take(drive_info_t *di, unsigned int start, unsigned int count);
+int     ide_xfer_start(ide_host_t *ih, ide_xfer_t *x);
+int     ide_xfer_service(ide_host_t *ih, ide_xfer_t *x);
+int     ide_xfer_wants_reset(ide_xfer_t *x);
+int     ide_xfer_retry(ide_host_t *ih, ide_xfer_t *x);
+int     ide_xfer_polled(ide_host_t *ih, ide_xfer_t *x);
+int     ide_xfer_busy(ide_host_t *ih);
+int     ide_xfer_ready(ide_host_t *ih, ide_xfer_t *x);
+unsigned int ide_xfer_tmo(ide_xfer_t *x);
+int     ide_wait_nbsy(ide_host_t *ih, unsigned int ms);
+int     ide_wait_drq(ide_host_t *ih, unsigned int ms);
+void    ide_calibrate(ide_host_t *ih);
+
+/* Supplied by the code using this: give up the CPU for a while, if
+ * ih->can_yield says that's allowed.  Returns the time that's passed (us),
+ * or 0 if the caller should carry on spinning.
+ */
+int     ide_yield(ide_host_t *ih);
+
+/* Also supplied: a clock for ide_calibrate(), in microseconds, counting up
+ * and wrapping to 0 at *period.  *period is 0 if there's no such clock.
+ */
+unsigned int ide_timer(unsigned int *period);
 
 #endif
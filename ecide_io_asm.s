@@ -30,13 +30,21 @@ pc      .req    r15
 
         .text
 
-        .global _ide_read_data
+        @ Each routine moves a whole number of sectors, for a DRQ block of
+        @ one or more sectors (block-mode PIO).  Words are gathered into
+        @ 8-register ldm/stm groups, and the loop is unrolled so the
+        @ compare/branch is amortised over 32 or 64 bytes.  A count of
+        @ zero moves nothing.
+
+        .global _ide_read_sectors
         @ r0 = IO regs
         @ r1 = destination buffer
-        @ Read 512 bytes from the 16b data reg.
-_ide_read_data:
-        stmfd   sp!,{r4-r7}
-        mov     r2, #0
+        @ r2 = number of sectors
+        @ Read r2*512 bytes from the 16b data reg.
+_ide_read_sectors:
+        movs    r2, r2, lsl #3          @ 64 bytes per loop
+        moveqs  pc, lr
+        stmfd   sp!,{r4-r11}
 1:
         ldr     r3, [r0, #0]
         mov     r3, r3, lsl #16
@@ -62,73 +70,181 @@ _ide_read_data:
         ldr     r7, [r0, #0]
         orr     r7, r3, r7, lsl #16
 
-        stmia   r1!, {r4, r5, r6, r7}
+        ldr     r3, [r0, #0]
+        mov     r3, r3, lsl #16
+        mov     r3, r3, lsr #16
+        ldr     r8, [r0, #0]
+        orr     r8, r3, r8, lsl #16
+
+        ldr     r3, [r0, #0]
+        mov     r3, r3, lsl #16
+        mov     r3, r3, lsr #16
+        ldr     r9, [r0, #0]
+        orr     r9, r3, r9, lsl #16
+
+        ldr     r3, [r0, #0]
+        mov     r3, r3, lsl #16
+        mov     r3, r3, lsr #16
+        ldr     r10, [r0, #0]
+        orr     r10, r3, r10, lsl #16
+
+        ldr     r3, [r0, #0]
+        mov     r3, r3, lsl #16
+        mov     r3, r3, lsr #16
+        ldr     r11, [r0, #0]
+        orr     r11, r3, r11, lsl #16
+
+        stmia   r1!, {r4-r11}
+
+        ldr     r3, [r0, #0]
+        mov     r3, r3, lsl #16
+        mov     r3, r3, lsr #16
+        ldr     r4, [r0, #0]
+        orr     r4, r3, r4, lsl #16
+
+        ldr     r3, [r0, #0]
+        mov     r3, r3, lsl #16
+        mov     r3, r3, lsr #16
+        ldr     r5, [r0, #0]
+        orr     r5, r3, r5, lsl #16
+
+        ldr     r3, [r0, #0]
+        mov     r3, r3, lsl #16
+        mov     r3, r3, lsr #16
+        ldr     r6, [r0, #0]
+        orr     r6, r3, r6, lsl #16
+
+        ldr     r3, [r0, #0]
+        mov     r3, r3, lsl #16
+        mov     r3, r3, lsr #16
+        ldr     r7, [r0, #0]
+        orr     r7, r3, r7, lsl #16
+
+        ldr     r3, [r0, #0]
+        mov     r3, r3, lsl #16
+        mov     r3, r3, lsr #16
+        ldr     r8, [r0, #0]
+        orr     r8, r3, r8, lsl #16
+
+        ldr     r3, [r0, #0]
+        mov     r3, r3, lsl #16
+        mov     r3, r3, lsr #16
+        ldr     r9, [r0, #0]
+        orr     r9, r3, r9, lsl #16
+
+        ldr     r3, [r0, #0]
+        mov     r3, r3, lsl #16
+        mov     r3, r3, lsr #16
+        ldr     r10, [r0, #0]
+        orr     r10, r3, r10, lsl #16
+
+        ldr     r3, [r0, #0]
+        mov     r3, r3, lsl #16
+        mov     r3, r3, lsr #16
+        ldr     r11, [r0, #0]
+        orr     r11, r3, r11, lsl #16
+
+        stmia   r1!, {r4-r11}
 
-        add     r2, r2, #1
-        cmp     r2, #(512/4/4)
-        blt     1b
-        ldmfd   sp!,{r4-r7}
+        subs    r2, r2, #1
+        bne     1b
+        ldmfd   sp!,{r4-r11}
         movs    pc, lr
 
 
-        .global _ide_read_data8
+        .global _ide_read_sectors8
         @ r0 = IO regs
         @ r1 = High-byte latch
         @ r2 = destination buffer
-        @ Read 512 bytes from the 8b data reg + 8b HBL.
-_ide_read_data8:
-        stmfd   sp!,{r4-r8}
-        mov     r8, #0
+        @ r3 = number of sectors
+        @ Read r3*512 bytes from the 8b data reg + 8b HBL.
+_ide_read_sectors8:
+        movs    r3, r3, lsl #4          @ 32 bytes per loop
+        moveqs  pc, lr
+        stmfd   sp!,{r4-r11}
 1:
-        ldrb    r3, [r0, #0]
+        ldrb    ip, [r0, #0]
         ldrb    r4, [r1]
-        orr     r3, r3, r4, lsl #8
+        orr     ip, ip, r4, lsl #8
         ldrb    r4, [r0, #0]
-        orr     r3, r3, r4, lsl #16
+        orr     ip, ip, r4, lsl #16
         ldrb    r4, [r1]
-        orr     r4, r3, r4, lsl #24
+        orr     r4, ip, r4, lsl #24
 
-        ldrb    r3, [r0, #0]
+        ldrb    ip, [r0, #0]
         ldrb    r5, [r1]
-        orr     r3, r3, r5, lsl #8
+        orr     ip, ip, r5, lsl #8
         ldrb    r5, [r0, #0]
-        orr     r3, r3, r5, lsl #16
+        orr     ip, ip, r5, lsl #16
         ldrb    r5, [r1]
-        orr     r5, r3, r5, lsl #24
+        orr     r5, ip, r5, lsl #24
 
-        ldrb    r3, [r0, #0]
+        ldrb    ip, [r0, #0]
         ldrb    r6, [r1]
-        orr     r3, r3, r6, lsl #8
+        orr     ip, ip, r6, lsl #8
         ldrb    r6, [r0, #0]
-        orr     r3, r3, r6, lsl #16
+        orr     ip, ip, r6, lsl #16
         ldrb    r6, [r1]
-        orr     r6, r3, r6, lsl #24
+        orr     r6, ip, r6, lsl #24
 
-        ldrb    r3, [r0, #0]
+        ldrb    ip, [r0, #0]
         ldrb    r7, [r1]
-        orr     r3, r3, r7, lsl #8
+        orr     ip, ip, r7, lsl #8
         ldrb    r7, [r0, #0]
-        orr     r3, r3, r7, lsl #16
+        orr     ip, ip, r7, lsl #16
         ldrb    r7, [r1]
-        orr     r7, r3, r7, lsl #24
+        orr     r7, ip, r7, lsl #24
+
+        ldrb    ip, [r0, #0]
+        ldrb    r8, [r1]
+        orr     ip, ip, r8, lsl #8
+        ldrb    r8, [r0, #0]
+        orr     ip, ip, r8, lsl #16
+        ldrb    r8, [r1]
+        orr     r8, ip, r8, lsl #24
+
+        ldrb    ip, [r0, #0]
+        ldrb    r9, [r1]
+        orr     ip, ip, r9, lsl #8
+        ldrb    r9, [r0, #0]
+        orr     ip, ip, r9, lsl #16
+        ldrb    r9, [r1]
+        orr     r9, ip, r9, lsl #24
 
-        stmia   r2!, {r4, r5, r6, r7}
+        ldrb    ip, [r0, #0]
+        ldrb    r10, [r1]
+        orr     ip, ip, r10, lsl #8
+        ldrb    r10, [r0, #0]
+        orr     ip, ip, r10, lsl #16
+        ldrb    r10, [r1]
+        orr     r10, ip, r10, lsl #24
 
-        add     r8, r8, #1
-        cmp     r8, #(512/4/4)
-        blt     1b
-        ldmfd   sp!,{r4-r8}
+        ldrb    ip, [r0, #0]
+        ldrb    r11, [r1]
+        orr     ip, ip, r11, lsl #8
+        ldrb    r11, [r0, #0]
+        orr     ip, ip, r11, lsl #16
+        ldrb    r11, [r1]
+        orr     r11, ip, r11, lsl #24
+
+        stmia   r2!, {r4-r11}
+
+        subs    r3, r3, #1
+        bne     1b
+        ldmfd   sp!,{r4-r11}
         movs    pc, lr
 
 
-        .global _ide_write_data
+        .global _ide_write_sectors
         @ r0 = IO regs
         @ r1 = source buffer
-_ide_write_data:
-        stmfd   sp!,{r4-r7}
-        mov     r2, #0
+        @ r2 = number of sectors
+_ide_write_sectors:
+        movs    r2, r2, lsl #3          @ 64 bytes per loop
+        moveqs  pc, lr
+        stmfd   sp!,{r4-r11}
 1:
-        ldmia   r1!, {r4-r7}
+        ldmia   r1!, {r4-r11}
 
         mov     r3, r4, lsl#16  @ Store low hword to D[31:16]
         str     r3, [r0, #0]
@@ -146,57 +262,216 @@ _ide_write_data:
         str     r3, [r0, #0]
         str     r7, [r0, #0]
 
-        add     r2, r2, #1
-        cmp     r2, #(512/4/4)
-        blt     1b
-        ldmfd   sp!,{r4-r7}
+        mov     r3, r8, lsl#16
+        str     r3, [r0, #0]
+        str     r8, [r0, #0]
+
+        mov     r3, r9, lsl#16
+        str     r3, [r0, #0]
+        str     r9, [r0, #0]
+
+        mov     r3, r10, lsl#16
+        str     r3, [r0, #0]
+        str     r10, [r0, #0]
+
+        mov     r3, r11, lsl#16
+        str     r3, [r0, #0]
+        str     r11, [r0, #0]
+
+        ldmia   r1!, {r4-r11}
+
+        mov     r3, r4, lsl#16
+        str     r3, [r0, #0]
+        str     r4, [r0, #0]
+
+        mov     r3, r5, lsl#16
+        str     r3, [r0, #0]
+        str     r5, [r0, #0]
+
+        mov     r3, r6, lsl#16
+        str     r3, [r0, #0]
+        str     r6, [r0, #0]
+
+        mov     r3, r7, lsl#16
+        str     r3, [r0, #0]
+        str     r7, [r0, #0]
+
+        mov     r3, r8, lsl#16
+        str     r3, [r0, #0]
+        str     r8, [r0, #0]
+
+        mov     r3, r9, lsl#16
+        str     r3, [r0, #0]
+        str     r9, [r0, #0]
+
+        mov     r3, r10, lsl#16
+        str     r3, [r0, #0]
+        str     r10, [r0, #0]
+
+        mov     r3, r11, lsl#16
+        str     r3, [r0, #0]
+        str     r11, [r0, #0]
+
+        subs    r2, r2, #1
+        bne     1b
+        ldmfd   sp!,{r4-r11}
         movs    pc, lr
 
 
-        .global _ide_write_data8
+        .global _ide_write_sectors8
         @ r0 = IO regs
         @ r1 = High-byte latch
         @ r2 = source buffer
-_ide_write_data8:
-        stmfd   sp!,{r4-r8}
-        mov     r8, #0
+        @ r3 = number of sectors
+_ide_write_sectors8:
+        movs    r3, r3, lsl #4          @ 32 bytes per loop
+        moveqs  pc, lr
+        stmfd   sp!,{r4-r11}
 1:
-        ldmia   r2!, {r4-r7}
+        ldmia   r2!, {r4-r11}
 
-        mov     r3, r4, lsr#8
-        strb    r3, [r1]
+        mov     ip, r4, lsr#8
+        strb    ip, [r1]
         strb    r4, [r0, #0]
-        mov     r3, r4, lsr#24
+        mov     ip, r4, lsr#24
         mov     r4, r4, lsr#16
-        strb    r3, [r1]
+        strb    ip, [r1]
         strb    r4, [r0, #0]
 
-        mov     r3, r5, lsr#8
-        strb    r3, [r1]
+        mov     ip, r5, lsr#8
+        strb    ip, [r1]
         strb    r5, [r0, #0]
-        mov     r3, r5, lsr#24
+        mov     ip, r5, lsr#24
         mov     r5, r5, lsr#16
-        strb    r3, [r1]
+        strb    ip, [r1]
         strb    r5, [r0, #0]
 
-        mov     r3, r6, lsr#8
-        strb    r3, [r1]
+        mov     ip, r6, lsr#8
+        strb    ip, [r1]
         strb    r6, [r0, #0]
-        mov     r3, r6, lsr#24
+        mov     ip, r6, lsr#24
         mov     r6, r6, lsr#16
-        strb    r3, [r1]
+        strb    ip, [r1]
         strb    r6, [r0, #0]
 
-        mov     r3, r7, lsr#8
-        strb    r3, [r1]
+        mov     ip, r7, lsr#8
+        strb    ip, [r1]
         strb    r7, [r0, #0]
-        mov     r3, r7, lsr#24
+        mov     ip, r7, lsr#24
         mov     r7, r7, lsr#16
-        strb    r3, [r1]
+        strb    ip, [r1]
         strb    r7, [r0, #0]
 
-        add     r8, r8, #1
-        cmp     r8, #(512/4/4)
-        blt     1b
-        ldmfd   sp!,{r4-r8}
+        mov     ip, r8, lsr#8
+        strb    ip, [r1]
+        strb    r8, [r0, #0]
+        mov     ip, r8, lsr#24
+        mov     r8, r8, lsr#16
+        strb    ip, [r1]
+        strb    r8, [r0, #0]
+
+        mov     ip, r9, lsr#8
+        strb    ip, [r1]
+        strb    r9, [r0, #0]
+        mov     ip, r9, lsr#24
+        mov     r9, r9, lsr#16
+        strb    ip, [r1]
+        strb    r9, [r0, #0]
+
+        mov     ip, r10, lsr#8
+        strb    ip, [r1]
+        strb    r10, [r0, #0]
+        mov     ip, r10, lsr#24
+        mov     r10, r10, lsr#16
+        strb    ip, [r1]
+        strb    r10, [r0, #0]
+
+        mov     ip, r11, lsr#8
+        strb    ip, [r1]
+        strb    r11, [r0, #0]
+        mov     ip, r11, lsr#24
+        mov     r11, r11, lsr#16
+        strb    ip, [r1]
+        strb    r11, [r0, #0]
+
+        subs    r3, r3, #1
+        bne     1b
+        ldmfd   sp!,{r4-r11}
+        movs    pc, lr
+
+
+        @ Burst versions, for cards whose data register is decoded across a
+        @ 32-byte window: one ldm/stm moves 8 halfwords.
+
+        .global _ide_read_burst
+        @ r0 = data window
+        @ r1 = destination buffer
+        @ r2 = number of sectors
+_ide_read_burst:
+        movs    r2, r2, lsl #4          @ 32 bytes per loop
+        moveqs  pc, lr
+        stmfd   sp!,{r4-r11}
+1:
+        ldmia   r0, {r4-r11}            @ 8 halfwords, in D[15:0]
+        mov     r4, r4, lsl #16
+        mov     r4, r4, lsr #16
+        orr     r4, r4, r5, lsl #16
+        mov     r6, r6, lsl #16
+        mov     r6, r6, lsr #16
+        orr     r6, r6, r7, lsl #16
+        mov     r8, r8, lsl #16
+        mov     r8, r8, lsr #16
+        orr     r8, r8, r9, lsl #16
+        mov     r10, r10, lsl #16
+        mov     r10, r10, lsr #16
+        orr     r10, r10, r11, lsl #16
+        stmia   r1!, {r4, r6, r8, r10}
+
+        ldmia   r0, {r4-r11}            @ 8 halfwords, in D[15:0]
+        mov     r4, r4, lsl #16
+        mov     r4, r4, lsr #16
+        orr     r4, r4, r5, lsl #16
+        mov     r6, r6, lsl #16
+        mov     r6, r6, lsr #16
+        orr     r6, r6, r7, lsl #16
+        mov     r8, r8, lsl #16
+        mov     r8, r8, lsr #16
+        orr     r8, r8, r9, lsl #16
+        mov     r10, r10, lsl #16
+        mov     r10, r10, lsr #16
+        orr     r10, r10, r11, lsl #16
+        stmia   r1!, {r4, r6, r8, r10}
+
+        subs    r2, r2, #1
+        bne     1b
+        ldmfd   sp!,{r4-r11}
+        movs    pc, lr
+
+
+        .global _ide_write_burst
+        @ r0 = data window
+        @ r1 = source buffer
+        @ r2 = number of sectors
+_ide_write_burst:
+        movs    r2, r2, lsl #4          @ 32 bytes per loop
+        moveqs  pc, lr
+        stmfd   sp!,{r4-r11}
+1:
+        ldmia   r1!, {r5, r7, r9, r11}
+        mov     r4, r5, lsl#16  @ Low hword to D[31:16]
+        mov     r6, r7, lsl#16
+        mov     r8, r9, lsl#16
+        mov     r10, r11, lsl#16
+        stmia   r0, {r4-r11}            @ High hwords already in D[31:16]
+
+        ldmia   r1!, {r5, r7, r9, r11}
+        mov     r4, r5, lsl#16  @ Low hword to D[31:16]
+        mov     r6, r7, lsl#16
+        mov     r8, r9, lsl#16
+        mov     r10, r11, lsl#16
+        stmia   r0, {r4-r11}            @ High hwords already in D[31:16]
+
+        subs    r2, r2, #1
+        bne     1b
+        ldmfd   sp!,{r4-r11}
         movs    pc, lr
@@ -66,7 +66,7 @@
 
 static unsigned int     sector_from_cyl(drive_info_t *di, unsigned int cyl)
 {
-        return di->sec_per_track*di->heads*cyl;
+        return di->spc*cyl;
 }
 
 /* From NetBSD: */
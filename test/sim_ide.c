@@ -0,0 +1,1537 @@
+/* Linux-hosted simulation test
+ *
+ * Builds the portable parts of the driver (ecide_io.c, ecide_parts.c) against
+ * a simulated ATA device, whose register file is reached through the
+ * ECIDE_SIM hooks in ecide.h.  The device keeps its own virtual time (moved
+ * on by DELAY_()), goes busy for a while after each command/block, and
+ * raises INTRQ as a real drive would, so both the polled and IRQ-driven
+ * transfer paths can be exercised.
+ *
+ * Build & run with "make sim".
+ *
+ * Copyright (c) 2022 Matt Evans
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ecide.h"
+#include "ecide_io.h"
+#include "ecide_ataregs.h"
+#include "ecide_cache.h"
+
+#define SIM_SECTORS     4096            /* 2MB disc */
+#define SIM_CYL         64
+#define SIM_HEADS       4
+#define SIM_SPT         16
+#define SIM_CMD_US      50              /* Busy time per command/block */
+#define SIM_MULTI_MAX   16
+#define SIM_TICK_US     10000           /* Clock tick, for ide_yield() */
+#define SIM_RESET_US    500             /* Busy after SRST */
+
+enum { PH_IDLE, PH_BUSY_IN, PH_DATA_IN, PH_DATA_OUT, PH_BUSY_OUT, PH_RESET };
+
+typedef struct {
+        u8              seccnt, lba_lo, lba_mid, lba_hi, sdh;
+        u8              hob_seccnt, hob_lba_lo, hob_lba_mid, hob_lba_hi;
+        u8              features;
+        u8              xfer_mode;      /* From SET FEATURES */
+        int             wcache, rla;    /* Write cache, read look-ahead on */
+        int             cfa;            /* CompactFlash */
+        const char      *model;         /* IDENTIFY model, if not the usual */
+        int             empty;          /* No drive at all: the bus floats */
+        int             latch;          /* No drive, but registers hold what's
+                                         * written, and status reads BSY */
+        int             atapi;          /* Reset leaves a packet device's signature */
+        int             srst;           /* SRST is held */
+        unsigned int    bad_lba;        /* Fails with UNC... */
+        int             bad_left;       /*  this many more times */
+        int             hang;           /* Next read stays busy until reset */
+        unsigned long   spinup;         /* Next data command first spins up (us) */
+        u8              status, error;
+        int             intrq;
+        int             phase;
+        int             cmd;
+        unsigned long   busy_until;
+        unsigned int    lba;            /* Next sector of data phase */
+        unsigned int    left;           /* Sectors left in command */
+        unsigned int    multi;          /* SET MULTIPLE block size */
+        unsigned int    blk;            /* Sectors in current DRQ block */
+        u16             buf[256*SIM_MULTI_MAX];
+        int             buf_pos;
+        u16             secbuf[256];    /* For READ/WRITE BUFFER */
+        int             update_addr;    /* Leave last sector's address in taskfile */
+        unsigned int    cmd_lba;        /* Start of last data command */
+        u8              *disc;
+} sim_drive_t;
+
+static sim_drive_t      sim_drv;
+static unsigned long    sim_now;
+static unsigned int     sim_irqs;
+static unsigned int     sim_cmds;               /* Data commands issued */
+static unsigned int     sim_tf_writes;          /* Taskfile register writes */
+static unsigned int     sim_seek_us;            /* Extra busy time before a read */
+static unsigned int     sim_yields;
+static unsigned int     sim_flushes;
+static unsigned int     sim_erases;
+static unsigned int     sim_reg_us;             /* Extra time per register read */
+static unsigned char    sim_regfile[64];
+static unsigned char    sim_window[32];         /* All decodes to the data reg */
+static unsigned char    sim_ctlblock[32];       /* Device control/alt status */
+static unsigned char    sim_latched[8];         /* For sim_drv.latch */
+
+static int              failures;
+
+#define CHECK(cond, ...)        do { if (!(cond)) { printf("FAIL: " __VA_ARGS__); printf("\n"); failures++; } } while (0)
+
+/******************************************************************************/
+
+void DELAY_(int d);
+
+static void sim_raise(sim_drive_t *d)
+{
+        d->intrq = 1;
+        sim_irqs++;
+}
+
+static void sim_identify(sim_drive_t *d)
+{
+        char model[41];
+        static const char fw[] = "SIM 1.0 ";
+        int i;
+
+        sprintf(model, "%-40s", d->model ? d->model : "SIMULATED ATA DISC");
+        memset(d->buf, 0, sizeof(d->buf));
+        if (d->cfa)
+                d->buf[0] = 0x848a;
+        d->buf[1] = SIM_CYL;
+        d->buf[3] = SIM_HEADS;
+        d->buf[6] = SIM_SPT;
+        for (i = 0; i < 4; i++)
+                d->buf[23 + i] = (fw[i*2] << 8) | fw[i*2 + 1];
+        for (i = 0; i < 20; i++)
+                d->buf[27 + i] = (model[i*2] << 8) | model[i*2 + 1];
+        d->buf[47] = 0x8000 | SIM_MULTI_MAX;
+        d->buf[49] = 1 << 9;                    /* LBA */
+        d->buf[51] = 2 << 8;                    /* PIO2 */
+        d->buf[53] = 1 << 1;                    /* w64-70 valid */
+        d->buf[64] = 3;                         /* PIO3, PIO4 */
+        d->buf[68] = 120;
+        d->buf[82] = (1 << 12) | (1 << 13) |    /* WRITE/READ BUFFER */
+                (1 << 5) | (1 << 6);            /* Write cache, look-ahead */
+        d->buf[85] = (d->wcache ? 1 << 5 : 0) | (d->rla ? 1 << 6 : 0);
+        d->buf[60] = SIM_SECTORS & 0xffff;
+        d->buf[61] = SIM_SECTORS >> 16;
+        d->buf[83] = 0x4000 | (1 << 10);        /* LBA48 */
+        d->buf[86] = 1 << 10;
+        d->buf[100] = SIM_SECTORS & 0xffff;
+        d->buf[101] = SIM_SECTORS >> 16;
+}
+
+static unsigned int sim_cur_lba(sim_drive_t *d)
+{
+        unsigned int c = d->lba_mid | (d->lba_hi << 8);
+
+        if (!(d->sdh & 0x40))           /* CHS */
+                return (c * SIM_HEADS + (d->sdh & 0xf)) * SIM_SPT + d->lba_lo - 1;
+        return d->lba_lo | (d->lba_mid << 8) | (d->lba_hi << 16) | ((d->sdh & 0xf) << 24);
+}
+
+static int sim_is_multi(sim_drive_t *d)
+{
+        return d->cmd == WDCC_READ_MULTI || d->cmd == WDCC_WRITE_MULTI ||
+                d->cmd == WDCC_READ_MULTI_EXT || d->cmd == WDCC_WRITE_MULTI_EXT ||
+                d->cmd == WDCC_CFA_WRITE_MULTI_NE;
+}
+
+static int sim_is_ext(sim_drive_t *d)
+{
+        return d->cmd == WDCC_READ_EXT || d->cmd == WDCC_WRITE_EXT ||
+                d->cmd == WDCC_READ_MULTI_EXT || d->cmd == WDCC_WRITE_MULTI_EXT;
+}
+
+/* Size of the next DRQ block */
+static void sim_next_block(sim_drive_t *d)
+{
+        d->blk = 1;
+        if (sim_is_multi(d))
+                d->blk = d->left < d->multi ? d->left : d->multi;
+        d->buf_pos = 0;
+}
+
+static void sim_abort(sim_drive_t *d, u8 error)
+{
+        d->status = WDCS_READY | WDCS_ERR;
+        d->error = error;
+        d->phase = PH_IDLE;
+        sim_raise(d);
+}
+
+/* Does the current block hit the bad sector? */
+static int sim_bad_block(sim_drive_t *d)
+{
+        if (d->bad_left == 0 || d->bad_lba < d->lba || d->bad_lba >= d->lba + d->blk)
+                return 0;
+        d->bad_left--;
+        sim_abort(d, 0x40);                     /* UNC */
+        return 1;
+}
+
+static void sim_command(sim_drive_t *d, u8 cmd)
+{
+        d->cmd = cmd;
+        d->error = 0;
+        d->buf_pos = 0;
+        if (sim_is_ext(d)) {
+                d->lba = d->lba_lo | (d->lba_mid << 8) | (d->lba_hi << 16) |
+                        ((unsigned int)d->hob_lba_lo << 24);
+                if (d->hob_lba_mid || d->hob_lba_hi)
+                        d->lba = 0xffffffff;
+                d->left = (d->hob_seccnt << 8) | d->seccnt;
+                if (d->left == 0)
+                        d->left = 65536;
+        } else {
+                d->lba = sim_cur_lba(d);
+                d->left = d->seccnt ? d->seccnt : 256;
+        }
+        d->cmd_lba = d->lba;
+        if (cmd != WDCC_SET_MULTI && cmd != WDCC_IDENTIFY && cmd != WDCC_SET_FEATURES &&
+            cmd != WDCC_READ_BUFFER && cmd != WDCC_WRITE_BUFFER && cmd != WDCC_FLUSH_CACHE &&
+            cmd != WDCC_FLUSH_CACHE_EXT)
+                sim_cmds++;
+
+        if (sim_is_multi(d) && !d->multi) {
+                sim_abort(d, 0x04);             /* ABRT */
+                return;
+        }
+        switch (cmd) {
+        case WDCC_IDENTIFY:
+        case WDCC_READ_BUFFER:
+                d->left = 1;
+                /* Fall through */
+        case WDCC_READ:
+        case WDCC_READ_MULTI:
+        case WDCC_READ_EXT:
+        case WDCC_READ_MULTI_EXT:
+                d->status = WDCS_BUSY;
+                if (d->hang) {
+                        d->hang = 0;
+                        d->phase = PH_IDLE;     /* Never comes back */
+                        break;
+                }
+                d->phase = PH_BUSY_IN;
+                d->busy_until = sim_now + SIM_CMD_US + sim_seek_us + d->spinup;
+                d->spinup = 0;
+                break;
+        case WDCC_CFA_WRITE_NE:
+        case WDCC_CFA_WRITE_MULTI_NE:
+                if (!d->cfa) {
+                        sim_abort(d, 0x04);
+                        return;
+                }
+                /* Fall through */
+        case WDCC_WRITE:
+        case WDCC_WRITE_MULTI:
+        case WDCC_WRITE_EXT:
+        case WDCC_WRITE_MULTI_EXT:
+        case WDCC_WRITE_BUFFER:
+                if (cmd == WDCC_WRITE_BUFFER)
+                        d->left = 1;
+                /* No IRQ for the first block */
+                sim_next_block(d);
+                d->status = WDCS_READY | WDCS_DRQ;
+                d->phase = PH_DATA_OUT;
+                break;
+        case WDCC_SET_FEATURES:
+                if (d->features == WDSF_WCACHE_ON || d->features == WDSF_WCACHE_OFF) {
+                        d->wcache = d->features == WDSF_WCACHE_ON;
+                } else if (d->features == WDSF_RLA_ON || d->features == WDSF_RLA_OFF) {
+                        d->rla = d->features == WDSF_RLA_ON;
+                } else if (d->features != WDSF_SET_MODE ||
+                    (d->seccnt & 0xf8) != WDSF_MODE_PIO || (d->seccnt & 7) > 4) {
+                        sim_abort(d, 0x04);
+                        return;
+                } else {
+                        d->xfer_mode = d->seccnt;
+                }
+                d->status = WDCS_READY;
+                d->phase = PH_IDLE;
+                sim_raise(d);
+                break;
+        case WDCC_CFA_ERASE:
+                if (!d->cfa || d->lba + d->left > SIM_SECTORS) {
+                        sim_abort(d, 0x04);
+                        return;
+                }
+                memset(d->disc + d->lba*512, 0xff, d->left*512);
+                sim_erases++;
+                d->status = WDCS_READY;
+                d->phase = PH_IDLE;
+                sim_raise(d);
+                break;
+        case WDCC_FLUSH_CACHE:
+        case WDCC_FLUSH_CACHE_EXT:
+                sim_flushes++;
+                d->status = WDCS_READY;
+                d->phase = PH_IDLE;
+                sim_raise(d);
+                break;
+        case WDCC_SET_MULTI:
+                if (d->seccnt > SIM_MULTI_MAX || (d->seccnt & (d->seccnt - 1))) {
+                        sim_abort(d, 0x04);
+                        return;
+                }
+                d->multi = d->seccnt;
+                d->status = WDCS_READY;
+                d->phase = PH_IDLE;
+                sim_raise(d);
+                break;
+        default:
+                sim_abort(d, 0x04);
+        }
+}
+
+/* A data command has finished; old drives report the last sector's address */
+static void sim_cmd_end(sim_drive_t *d)
+{
+        unsigned int last = d->lba - 1;
+
+        d->status = WDCS_READY;
+        d->phase = PH_IDLE;
+        if (!d->update_addr || sim_is_ext(d) || !(d->sdh & 0x40))
+                return;
+        d->lba_lo = last & 0xff;
+        d->lba_mid = (last >> 8) & 0xff;
+        d->lba_hi = (last >> 16) & 0xff;
+        d->sdh = (d->sdh & 0xf0) | ((last >> 24) & 0xf);
+}
+
+/* Move the device on to the next state if its busy time has elapsed */
+static void sim_update(sim_drive_t *d)
+{
+        if (sim_now < d->busy_until)
+                return;
+
+        switch (d->phase) {
+        case PH_BUSY_IN:
+                sim_next_block(d);
+                if (d->cmd == WDCC_IDENTIFY) {
+                        sim_identify(d);
+                } else if (d->cmd == WDCC_READ_BUFFER) {
+                        memcpy(d->buf, d->secbuf, 512);
+                } else if (d->lba + d->blk > SIM_SECTORS) {
+                        sim_abort(d, 0x10);     /* IDNF */
+                        return;
+                } else if (sim_bad_block(d)) {
+                        return;
+                } else {
+                        memcpy(d->buf, d->disc + d->lba*512, d->blk*512);
+                }
+                d->status = WDCS_READY | WDCS_DRQ;
+                d->phase = PH_DATA_IN;
+                sim_raise(d);
+                break;
+        case PH_BUSY_OUT:
+                if (d->cmd == WDCC_WRITE_BUFFER) {
+                        memcpy(d->secbuf, d->buf, 512);
+                } else if (d->lba + d->blk > SIM_SECTORS) {
+                        sim_abort(d, 0x10);
+                        return;
+                } else if (sim_bad_block(d)) {
+                        return;
+                } else {
+                        memcpy(d->disc + d->lba*512, d->buf, d->blk*512);
+                }
+                d->lba += d->blk;
+                d->left -= d->blk;
+                if (d->left) {
+                        sim_next_block(d);
+                        d->status = WDCS_READY | WDCS_DRQ;
+                        d->phase = PH_DATA_OUT;
+                } else {
+                        sim_cmd_end(d);
+                }
+                sim_raise(d);
+                break;
+        case PH_RESET:
+                /* Back to power-on settings */
+                d->multi = 0;
+                d->xfer_mode = 0;
+                d->wcache = 0;
+                d->rla = 0;
+                d->seccnt = 1;
+                d->lba_lo = 1;
+                d->lba_mid = d->atapi ? WDSIG_ATAPI_MID : 0;
+                d->lba_hi = d->atapi ? WDSIG_ATAPI_HI : 0;
+                d->sdh = 0;
+                d->error = 1;                   /* Diagnostics passed */
+                d->status = WDCS_READY;
+                d->phase = PH_IDLE;
+                break;
+        }
+}
+
+static void sim_data_done(sim_drive_t *d)
+{
+        if (d->phase == PH_DATA_IN) {
+                d->lba += d->blk;
+                d->left -= d->blk;
+                if (d->left) {
+                        d->status = WDCS_BUSY;
+                        d->phase = PH_BUSY_IN;
+                        d->busy_until = sim_now + SIM_CMD_US;
+                } else {
+                        sim_cmd_end(d);
+                }
+        } else {
+                /* A write's first block is taken before spinning up */
+                d->status = WDCS_BUSY;
+                d->phase = PH_BUSY_OUT;
+                d->busy_until = sim_now + SIM_CMD_US + d->spinup;
+                d->spinup = 0;
+        }
+}
+
+unsigned int    sim_read_reg(regs_t base, unsigned int reg, int width)
+{
+        sim_drive_t *d = &sim_drv;
+        unsigned int v;
+
+        sim_now += sim_reg_us;
+        sim_update(d);
+        if (d->empty)
+                return reg == wd_status ? 0x7f : 0xff;
+        if (d->latch && base != sim_window)
+                return reg == wd_status || base == sim_ctlblock ? WDCS_BUSY :
+                        sim_latched[reg & 7];
+        if (base == sim_ctlblock) {
+                if (reg != wd_altstatus)
+                        return 0xff;
+                return (d->sdh & 0x10) ? 0 : d->status;
+        }
+        if (base == sim_window)
+                reg = wd_data;
+        /* Drive 1 is absent: drive 0 answers for it, but with status 0 */
+        if ((d->sdh & 0x10) && (reg == wd_status || reg == wd_data))
+                return 0;
+        /* While busy, the other registers read as status */
+        if ((d->status & WDCS_BUSY) && reg != wd_data)
+                reg = wd_status;
+
+        switch (reg) {
+        case wd_data:
+                if (d->phase != PH_DATA_IN)
+                        return 0xffff;
+                v = d->buf[d->buf_pos++];
+                if (d->buf_pos == d->blk*256)
+                        sim_data_done(d);
+                return width == 8 ? (v & 0xff) : v;
+        case wd_error:          return d->error;
+        case wd_seccnt:         return d->seccnt;
+        case wd_sector:         return d->lba_lo;
+        case wd_cyl_lo:         return d->lba_mid;
+        case wd_cyl_hi:         return d->lba_hi;
+        case wd_sdh:            return d->sdh;
+        case wd_status:
+                d->intrq = 0;
+                return d->status;
+        }
+        return 0xff;
+}
+
+void            sim_write_reg(regs_t base, unsigned int reg, unsigned int value, int width)
+{
+        sim_drive_t *d = &sim_drv;
+
+        sim_update(d);
+        if (d->empty)
+                return;
+        if (d->latch) {
+                if (base != sim_ctlblock && base != sim_window)
+                        sim_latched[reg & 7] = value;
+                return;
+        }
+        if (base == sim_ctlblock) {
+                if (reg != wd_devctl)
+                        return;
+                if (value & WDCTL_RST) {
+                        d->srst = 1;
+                        d->status = WDCS_BUSY;
+                        d->phase = PH_IDLE;
+                        d->intrq = 0;
+                } else if (d->srst) {
+                        d->srst = 0;
+                        d->phase = PH_RESET;
+                        d->busy_until = sim_now + SIM_RESET_US;
+                }
+                return;
+        }
+        if (base == sim_window)
+                reg = wd_data;
+        value &= (width == 8) ? 0xff : 0xffff;
+        if (reg != wd_data && reg != wd_command)
+                sim_tf_writes++;
+        switch (reg) {
+        case wd_data:
+                if (d->phase != PH_DATA_OUT)
+                        return;
+                d->buf[d->buf_pos++] = value;
+                if (d->buf_pos == d->blk*256)
+                        sim_data_done(d);
+                break;
+        case wd_features:       d->features = value; break;
+        /* The taskfile registers are two-deep FIFOs, for LBA48 */
+        case wd_seccnt:         d->hob_seccnt = d->seccnt; d->seccnt = value; break;
+        case wd_sector:         d->hob_lba_lo = d->lba_lo; d->lba_lo = value; break;
+        case wd_cyl_lo:         d->hob_lba_mid = d->lba_mid; d->lba_mid = value; break;
+        case wd_cyl_hi:         d->hob_lba_hi = d->lba_hi; d->lba_hi = value; break;
+        case wd_sdh:            d->sdh = value; break;
+        case wd_command:
+                if (d->sdh & 0x10)
+                        break;
+                if (d->status & WDCS_BUSY)
+                        break;
+                sim_command(d, value);
+                break;
+        }
+}
+
+void DELAY_(int d)
+{
+        sim_now += d;
+        sim_update(&sim_drv);
+}
+
+/* As the driver would sleep for a tick, if it's allowed to */
+int ide_yield(ide_host_t *ih)
+{
+        if (!ih->can_yield)
+                return 0;
+        sim_yields++;
+        DELAY_(SIM_TICK_US);
+        return SIM_TICK_US;
+}
+
+/* The clock for ide_calibrate(), wrapping each tick as the kernel's does */
+unsigned int ide_timer(unsigned int *period)
+{
+        *period = SIM_TICK_US;
+        return sim_now % SIM_TICK_US;
+}
+
+/* Let time pass until the device raises INTRQ; returns 0 on timeout */
+static int sim_wait_irq(void)
+{
+        unsigned long deadline = sim_now + 1000*1000;
+
+        while (!sim_drv.intrq) {
+                if (sim_now > deadline)
+                        return 0;
+                DELAY_(1);
+        }
+        return 1;
+}
+
+/******************************************************************************/
+
+static u8 *disc;
+static u8 wbuf[512*1000];
+static u8 rbuf[512*1000];
+static ide_host_t ide;
+
+static void fill_pattern(u8 *p, unsigned int len, unsigned int seed)
+{
+        unsigned int i;
+
+        for (i = 0; i < len; i++)
+                p[i] = (i * 7 + seed * 13 + (i >> 9)) & 0xff;
+}
+
+/* Run a transfer using only the IRQ-driven path */
+static int irq_xfer(unsigned int sector, unsigned int count, u8 *addr, int write,
+                    unsigned int *irqs)
+{
+        ide_xfer_t *x = &ide.xfer;
+        int r;
+
+        x->drive = 0;
+        x->sector = sector;
+        x->count = count;
+        x->addr = addr;
+        x->nsegs = 0;
+        x->write = write;
+        x->noerase = 0;
+        *irqs = 0;
+        r = ide_xfer_start(&ide, x);
+        while (r == IDE_XFER_MORE) {
+                if (!sim_wait_irq())
+                        return -1;
+                (*irqs)++;
+                r = ide_xfer_service(&ide, x);
+        }
+        return r;
+}
+
+static void test_init(void)
+{
+        int r;
+
+        ide.regs = sim_regfile;
+
+        /* The card's PIO limit applies */
+        ide.pio_max = 2;
+        r = ide_init(&ide, 0, rbuf);
+        CHECK(r == 1 && ide.drives[0].pio_max == 4 && ide.drives[0].pio_mode == 2 &&
+              sim_drv.xfer_mode == (WDSF_MODE_PIO | 2), "capped PIO mode %d, drive %02x",
+              ide.drives[0].pio_mode, sim_drv.xfer_mode);
+
+        /* Features are set as asked, if the drive has them */
+        sim_drv.rla = 1;
+        ide.features = IDE_F_WCACHE;
+        r = ide_init(&ide, 0, rbuf);
+        CHECK(r == 1 && sim_drv.wcache && !sim_drv.rla &&
+              ide.drives[0].feat_on == IDE_F_WCACHE, "features %x, drive %d/%d",
+              ide.drives[0].feat_on, sim_drv.wcache, sim_drv.rla);
+        sim_flushes = 0;
+        r = ide_flush_cache(&ide, 0);
+        CHECK(r == 0 && sim_flushes == 1 && sim_drv.cmd == WDCC_FLUSH_CACHE_EXT,
+              "flush cache (%d, %d, cmd %02x)", r, sim_flushes, sim_drv.cmd);
+        ide.drives[0].lba48 = 0;
+        r = ide_flush_cache(&ide, 0);
+        CHECK(r == 0 && sim_flushes == 2 && sim_drv.cmd == WDCC_FLUSH_CACHE,
+              "28-bit flush cache (%d, %d, cmd %02x)", r, sim_flushes, sim_drv.cmd);
+        ide.drives[0].lba48 = 1;
+        ide.features = IDE_F_LOOKAHEAD;
+        r = ide_init(&ide, 0, rbuf);
+        CHECK(r == 1 && !sim_drv.wcache && sim_drv.rla &&
+              ide.drives[0].feat_on == IDE_F_LOOKAHEAD, "features %x, drive %d/%d",
+              ide.drives[0].feat_on, sim_drv.wcache, sim_drv.rla);
+        r = ide_flush_cache(&ide, 0);
+        CHECK(r == 0 && sim_flushes == 2, "flush with write cache off");
+
+        ide.pio_max = 4;
+        ide.features = IDE_F_WCACHE | IDE_F_LOOKAHEAD;
+        r = ide_init(&ide, 0, rbuf);
+        CHECK(r == 1, "ide_init found %d drives", r);
+        CHECK(ide.drives[0].present && !ide.drives[1].present, "drive presence");
+        CHECK(ide.drives[0].total_sectors == SIM_SECTORS, "capacity %d",
+              ide.drives[0].total_sectors);
+        CHECK(ide.drives[0].multi == SIM_MULTI_MAX, "multiple mode %d",
+              ide.drives[0].multi);
+        CHECK(ide.drives[0].lba48, "LBA48 not detected");
+        CHECK(ide.drives[0].pio_mode == 4 && sim_drv.xfer_mode == (WDSF_MODE_PIO | 4),
+              "PIO mode %d, drive %02x", ide.drives[0].pio_mode, sim_drv.xfer_mode);
+}
+
+static void test_polled(void)
+{
+        int r;
+
+        fill_pattern(wbuf, 300*512, 1);
+        r = ide_write_some(&ide, 0, 100, 300, wbuf);
+        CHECK(r == 0, "polled write");
+        CHECK(memcmp(disc + 100*512, wbuf, 300*512) == 0, "polled write data");
+
+        memset(rbuf, 0, 300*512);
+        r = ide_read_some(&ide, 0, 100, 300, rbuf);
+        CHECK(r == 0, "polled read");
+        CHECK(memcmp(rbuf, wbuf, 300*512) == 0, "polled read data");
+}
+
+/* Long runs go in one 48-bit command; short ones stay 28-bit */
+static void test_lba48(void)
+{
+        int r;
+
+        fill_pattern(wbuf, 1000*512, 4);
+        sim_cmds = 0;
+        r = ide_write_some(&ide, 0, 3000, 1000, wbuf);
+        CHECK(r == 0 && sim_cmds == 1, "EXT write (%d, %d commands)", r, sim_cmds);
+        sim_cmds = 0;
+        r = ide_read_some(&ide, 0, 3000, 1000, rbuf);
+        CHECK(r == 0 && sim_cmds == 1, "EXT read (%d, %d commands)", r, sim_cmds);
+        CHECK(memcmp(rbuf, wbuf, 1000*512) == 0, "EXT data");
+        CHECK(memcmp(disc + 3000*512, wbuf, 1000*512) == 0, "EXT disc data");
+
+        sim_cmds = 0;
+        r = ide_read_some(&ide, 0, 3000, 8, rbuf);
+        CHECK(r == 0 && sim_cmds == 1 && sim_drv.cmd == WDCC_READ_MULTI,
+              "short read used cmd %02x", sim_drv.cmd);
+
+        /* Without LBA48, the run's split into 128-sector commands */
+        ide.drives[0].lba48 = 0;
+        sim_cmds = 0;
+        memset(rbuf, 0, 300*512);
+        r = ide_read_some(&ide, 0, 3000, 300, rbuf);
+        CHECK(r == 0 && sim_cmds == 3, "28-bit read (%d, %d commands)", r, sim_cmds);
+        CHECK(memcmp(rbuf, wbuf, 300*512) == 0, "28-bit data");
+        ide.drives[0].lba48 = 1;
+}
+
+/* Number of DRQ blocks (so, IRQs) to move count sectors */
+static unsigned int expect_blocks(unsigned int count)
+{
+        unsigned int multi = ide.drives[0].multi ? ide.drives[0].multi : 1;
+        unsigned int cmd_limit = ide.drives[0].lba48 && count > 128 ? 65536 : 128;
+        unsigned int b = 0;
+
+        while (count) {
+                unsigned int n = count > cmd_limit ? cmd_limit : count;
+                b += (n + multi - 1) / multi;
+                count -= n;
+        }
+        return b;
+}
+
+static void test_irq(void)
+{
+        unsigned int irqs;
+        int r;
+
+        fill_pattern(wbuf, 300*512, 2);
+        r = irq_xfer(1000, 300, wbuf, 1, &irqs);
+        CHECK(r == IDE_XFER_DONE, "IRQ write (%d)", r);
+        CHECK(memcmp(disc + 1000*512, wbuf, 300*512) == 0, "IRQ write data");
+        CHECK(irqs == expect_blocks(300), "IRQ write took %d IRQs", irqs);
+
+        memset(rbuf, 0, 300*512);
+        r = irq_xfer(1000, 300, rbuf, 0, &irqs);
+        CHECK(r == IDE_XFER_DONE, "IRQ read (%d)", r);
+        CHECK(memcmp(rbuf, wbuf, 300*512) == 0, "IRQ read data");
+        CHECK(irqs == expect_blocks(300), "IRQ read took %d IRQs", irqs);
+
+        /* Errors are reported, with the position reached */
+        r = irq_xfer(SIM_SECTORS - 40, 64, rbuf, 0, &irqs);
+        CHECK(r == IDE_XFER_ERROR, "IRQ read past end (%d)", r);
+        CHECK(ide.xfer.count == 64 - 32, "IRQ error position, %d left", ide.xfer.count);
+}
+
+/* Without multiple mode, it's one sector per DRQ */
+static void test_single(void)
+{
+        unsigned int irqs;
+        unsigned int multi = ide.drives[0].multi;
+        int r;
+
+        ide.drives[0].multi = 0;
+        fill_pattern(wbuf, sizeof(wbuf), 3);
+        r = irq_xfer(2000, 20, wbuf, 1, &irqs);
+        CHECK(r == IDE_XFER_DONE && irqs == 20, "single-sector write (%d, %d IRQs)", r, irqs);
+        r = irq_xfer(2000, 20, rbuf, 0, &irqs);
+        CHECK(r == IDE_XFER_DONE && irqs == 20, "single-sector read (%d, %d IRQs)", r, irqs);
+        CHECK(memcmp(rbuf, wbuf, 20*512) == 0, "single-sector data");
+        ide.drives[0].multi = multi;
+}
+
+/* Burst transfers through an aliased data window */
+static void test_window(void)
+{
+        int r;
+
+        /* The normal register block doesn't alias, so mustn't be used: */
+        r = ide_probe_window(&ide, 0, sim_regfile, rbuf);
+        CHECK(r == 0 && !ide.rd_window && !ide.wr_window, "non-window probe (%d)", r);
+        CHECK(sim_drv.phase == PH_IDLE, "drive left in data phase");
+
+        r = ide_probe_window(&ide, 0, sim_window, rbuf);
+        CHECK(r == 3 && ide.rd_window == sim_window && ide.wr_window == sim_window,
+              "window probe (%d)", r);
+
+        fill_pattern(wbuf, 200*512, 5);
+        r = ide_write_some(&ide, 0, 500, 200, wbuf);
+        CHECK(r == 0 && memcmp(disc + 500*512, wbuf, 200*512) == 0, "burst write");
+        memset(rbuf, 0, 200*512);
+        r = ide_read_some(&ide, 0, 500, 200, rbuf);
+        CHECK(r == 0 && memcmp(rbuf, wbuf, 200*512) == 0, "burst read");
+
+        ide.rd_window = 0;
+        ide.wr_window = 0;
+        ide_set_data_ops(&ide);
+}
+
+/* Unchanged taskfile registers aren't rewritten, whichever way the drive
+ * leaves the address registers after a command.
+ */
+static void test_shadow(void)
+{
+        static const unsigned int runs[][2] = {
+                { 240, 8 }, { 240, 8 }, { 248, 8 }, { 256, 8 }, { 300, 1 }, { 300, 1 },
+                { 1000, 4 }, { 0, 2 }, { 510, 4 }, { 2047, 2 }
+        };
+        unsigned int w1, w2;
+        int mode, i, r;
+
+        fill_pattern(disc, SIM_SECTORS*512, 6);
+        for (mode = 0; mode < 2; mode++) {
+                sim_drv.update_addr = mode;
+                for (i = 0; i < sizeof(runs)/sizeof(runs[0]); i++) {
+                        unsigned int s = runs[i][0];
+                        unsigned int n = runs[i][1];
+
+                        memset(rbuf, 0, n*512);
+                        r = ide_read_some(&ide, 0, s, n, rbuf);
+                        CHECK(r == 0 && sim_drv.cmd_lba == s &&
+                              memcmp(rbuf, disc + s*512, n*512) == 0,
+                              "shadowed read %d+%d (mode %d), drive used %d", s, n,
+                              mode, sim_drv.cmd_lba);
+                }
+        }
+        sim_drv.update_addr = 0;
+
+        sim_tf_writes = 0;
+        ide_tf_invalidate(&ide);
+        r = ide_read_some(&ide, 0, 100, 4, rbuf);
+        w1 = sim_tf_writes;
+        sim_tf_writes = 0;
+        r |= ide_read_some(&ide, 0, 104, 4, rbuf);
+        w2 = sim_tf_writes;
+        CHECK(r == 0 && w2 < w1 && w2 <= 2, "taskfile writes %d then %d", w1, w2);
+}
+
+/* CHS addressing, across track and cylinder boundaries and commands */
+static void test_chs(void)
+{
+        drive_info_t saved = ide.drives[0];
+        unsigned int irqs;
+        int r;
+
+        /* As though it were a CHS-only drive (ide_init made up an LBA
+         * geometry for it):
+         */
+        ide.drives[0].lba_supported = 0;
+        ide.drives[0].lba48 = 0;
+        ide.drives[0].heads = SIM_HEADS;
+        ide.drives[0].sec_per_track = SIM_SPT;
+        ide.drives[0].spc = SIM_HEADS*SIM_SPT;
+
+        fill_pattern(wbuf, 300*512, 7);
+        r = ide_write_some(&ide, 0, 2*SIM_HEADS*SIM_SPT - 5, 300, wbuf);
+        CHECK(r == 0 && memcmp(disc + (2*SIM_HEADS*SIM_SPT - 5)*512, wbuf, 300*512) == 0,
+              "CHS write");
+        sim_cmds = 0;
+        memset(rbuf, 0, 300*512);
+        r = irq_xfer(2*SIM_HEADS*SIM_SPT - 5, 300, rbuf, 0, &irqs);
+        CHECK(r == IDE_XFER_DONE && sim_cmds == 3 && memcmp(rbuf, wbuf, 300*512) == 0,
+              "CHS read (%d, %d commands)", r, sim_cmds);
+        r = ide_read_some(&ide, 0, SIM_SPT - 1, 2, rbuf);
+        CHECK(r == 0 && sim_drv.cmd_lba == SIM_SPT - 1 &&
+              memcmp(rbuf, disc + (SIM_SPT - 1)*512, 2*512) == 0, "CHS short read");
+
+        ide.drives[0] = saved;
+}
+
+/* One transfer, scattered over several memory segments (as for merged
+ * bufs), with DRQ blocks spanning segment boundaries.
+ */
+static void set_segs(ide_xfer_t *x, u8 *base, const unsigned int *counts, int n)
+{
+        int i;
+
+        x->nsegs = n;
+        x->count = 0;
+        for (i = 0; i < n; i++) {
+                /* Leave a gap after each, to catch overruns */
+                x->segs[i].addr = base + (x->count + i) * 512;
+                x->segs[i].count = counts[i];
+                x->count += counts[i];
+        }
+}
+
+static void test_segments(void)
+{
+        static const unsigned int counts[] = { 3, 5, 1, 20, 0, 7, 33 };
+        int n = sizeof(counts)/sizeof(counts[0]);
+        ide_xfer_t *x = &ide.xfer;
+        unsigned int total, i;
+        int r;
+
+        fill_pattern(wbuf, sizeof(wbuf), 8);
+        set_segs(x, wbuf, counts, n);
+        total = x->count;
+        x->drive = 0;
+        x->sector = 1500;
+        x->write = 1;
+        x->noerase = 0;
+        r = ide_xfer_polled(&ide, x);
+        CHECK(r == IDE_XFER_DONE && sim_drv.cmd_lba == 1500, "segmented write (%d)", r);
+
+        memset(rbuf, 0, sizeof(rbuf));
+        set_segs(x, rbuf, counts, n);
+        x->sector = 1500;
+        x->write = 0;
+        x->noerase = 0;
+        r = ide_xfer_polled(&ide, x);
+        CHECK(r == IDE_XFER_DONE, "segmented read (%d)", r);
+        for (i = 0; i < n; i++) {
+                CHECK(memcmp(x->segs[i].addr, wbuf + (x->segs[i].addr - rbuf),
+                             counts[i] * 512) == 0, "segment %d data", i);
+                CHECK(x->segs[i].addr[counts[i] * 512] == 0 &&
+                      x->segs[i].addr[counts[i] * 512 + 511] == 0, "segment %d overrun", i);
+        }
+        for (i = 0; i < n; i++)
+                CHECK(memcmp(disc + (1500 + (x->segs[i].addr - rbuf)/512 - i)*512,
+                             x->segs[i].addr, counts[i] * 512) == 0, "segment %d on disc", i);
+        CHECK(total == 69, "segment total");
+        x->nsegs = 0;
+}
+
+/* Step a transfer as the driver's background polling does: never waiting
+ * on the device, but leaving time to pass (a tick) whenever it's busy.
+ */
+static int nowait_xfer(unsigned int sector, unsigned int count, u8 *addr, int write,
+                       unsigned int *ticks)
+{
+        ide_xfer_t *x = &ide.xfer;
+        int r;
+
+        x->drive = 0;
+        x->sector = sector;
+        x->count = count;
+        x->addr = addr;
+        x->nsegs = 0;
+        x->write = write;
+        x->noerase = 0;
+        *ticks = 0;
+        r = ide_xfer_start(&ide, x);
+        while (r == IDE_XFER_MORE) {
+                if (ide_xfer_busy(&ide)) {
+                        if (++*ticks > 10000)
+                                return -1;
+                        DELAY_(SIM_CMD_US / 4);
+                        continue;
+                }
+                r = ide_xfer_service(&ide, x);
+        }
+        return r;
+}
+
+static void test_nowait(void)
+{
+        unsigned int ticks;
+        int r;
+
+        fill_pattern(wbuf, 200*512, 6);
+        r = nowait_xfer(700, 200, wbuf, 1, &ticks);
+        CHECK(r == IDE_XFER_DONE, "no-wait write (%d)", r);
+        CHECK(ticks > 0, "no-wait write never saw busy");
+        CHECK(memcmp(disc + 700*512, wbuf, 200*512) == 0, "no-wait write data");
+
+        memset(rbuf, 0, 200*512);
+        r = nowait_xfer(700, 200, rbuf, 0, &ticks);
+        CHECK(r == IDE_XFER_DONE, "no-wait read (%d)", r);
+        CHECK(ticks >= expect_blocks(200), "no-wait read, busy %d times", ticks);
+        CHECK(memcmp(rbuf, wbuf, 200*512) == 0, "no-wait read data");
+
+        r = nowait_xfer(SIM_SECTORS - 8, 16, rbuf, 0, &ticks);
+        CHECK(r == IDE_XFER_ERROR, "no-wait read past end (%d)", r);
+}
+
+/* As the driver's poll tick does: move up to quota sectors, waiting on the
+ * drive only via ide_xfer_ready(), then let the rest of the tick pass.
+ * Returns the ticks taken, or 0 if the transfer failed.
+ */
+static unsigned int tick_xfer(unsigned int sector, unsigned int count, u8 *addr,
+                              int write, unsigned int quota)
+{
+        ide_xfer_t *x = &ide.xfer;
+        unsigned int ticks = 0;
+        unsigned int left, moved;
+        int r;
+
+        x->drive = 0;
+        x->sector = sector;
+        x->count = count;
+        x->addr = addr;
+        x->nsegs = 0;
+        x->write = write;
+        x->noerase = 0;
+        r = ide_xfer_start(&ide, x);
+        while (r == IDE_XFER_MORE) {
+                DELAY_(SIM_TICK_US - sim_now % SIM_TICK_US);
+                if (++ticks > 10000)
+                        return 0;
+                for (moved = 0; r == IDE_XFER_MORE && moved < quota &&
+                             ide_xfer_ready(&ide, x); moved += left - x->count) {
+                        left = x->count;
+                        r = ide_xfer_service(&ide, x);
+                }
+        }
+        return r == IDE_XFER_DONE ? ticks : 0;
+}
+
+/* Background polling isn't held to a block a tick by the drive's BSY
+ * between blocks, but doesn't spin through a seek either.
+ */
+static void test_poll_ticks(void)
+{
+        unsigned int multi = ide.drives[0].multi;
+        unsigned int ticks, i;
+        unsigned long t, most = 0;
+
+        ide.drives[0].multi = 0;
+        fill_pattern(wbuf, 128*512, 11);
+        ticks = tick_xfer(500, 128, wbuf, 1, 32);
+        CHECK(ticks > 0 && ticks <= 128/32 + 1, "single-sector write took %d ticks", ticks);
+        CHECK(memcmp(disc + 500*512, wbuf, 128*512) == 0, "ticked write data");
+        memset(rbuf, 0, 128*512);
+        ticks = tick_xfer(500, 128, rbuf, 0, 32);
+        CHECK(ticks > 0 && ticks <= 128/32 + 1, "single-sector read took %d ticks", ticks);
+        CHECK(memcmp(rbuf, wbuf, 128*512) == 0, "ticked read data");
+        ide.drives[0].multi = multi;
+
+        /* A seek outlasts the spin, which gives up within IDE_SPIN_MAX */
+        sim_seek_us = 20000;
+        ide.xfer.drive = 0;
+        ide.xfer.sector = 500;
+        ide.xfer.count = 8;
+        ide.xfer.addr = rbuf;
+        ide.xfer.write = 0;
+        CHECK(ide_xfer_start(&ide, &ide.xfer) == IDE_XFER_MORE, "start for seek");
+        for (i = 0; i < 8; i++) {
+                t = sim_now;
+                if (ide_xfer_ready(&ide, &ide.xfer))
+                        break;
+                if (sim_now - t > most)
+                        most = sim_now - t;
+        }
+        CHECK(i == 8 && most <= 2000 + 100, "seek: ready after %d, spun %luus", i, most);
+        sim_seek_us = 0;
+        ticks = tick_xfer(500, 8, rbuf, 0, 32);
+        CHECK(ticks > 0, "read after seek");
+}
+
+/* Long waits yield when allowed, and the estimate of a drive's latency
+ * follows what it's doing.
+ */
+static void test_yield(void)
+{
+        drive_info_t *di = &ide.drives[0];
+        unsigned int y;
+        int i, r;
+
+        fill_pattern(wbuf, 64*512, 7);
+        memcpy(disc + 200*512, wbuf, 64*512);
+
+        /* Not allowed to sleep: spins through a seek */
+        sim_seek_us = 20000;
+        sim_yields = 0;
+        r = ide_read_some(&ide, 0, 200, 16, rbuf);
+        CHECK(r == 0 && sim_yields == 0, "seek without yield (%d, %d yields)", r, sim_yields);
+
+        ide.can_yield = 1;
+        di->wait_est = 0;
+        r = ide_read_some(&ide, 0, 200, 16, rbuf);
+        y = sim_yields;
+        CHECK(r == 0 && y >= 1 && y <= 3, "seek yielded %d times", y);
+        CHECK(memcmp(rbuf, wbuf, 16*512) == 0, "data after yield");
+
+        /* Only seeks: it learns not to spin long */
+        for (i = 0; i < 8; i++)
+                ide_read_one(&ide, 0, 200 + i, rbuf);
+        CHECK(di->wait_est > 1000, "estimate after seeks %d", di->wait_est);
+
+        /* The drive gets quick again; the estimate follows */
+        sim_seek_us = 0;
+        for (i = 0; i < 64; i++)
+                r |= ide_read_one(&ide, 0, 200 + i, rbuf + i*512);
+        CHECK(r == 0 && memcmp(rbuf, wbuf, 64*512) == 0, "quick reads");
+        CHECK(di->wait_est < 200, "estimate after quick reads %d", di->wait_est);
+        y = sim_yields;
+        r = ide_read_some(&ide, 0, 200, 64, rbuf);
+        CHECK(r == 0 && sim_yields == y, "quick read yielded %d times", sim_yields - y);
+
+        ide.can_yield = 0;
+}
+
+/* The sector cache: hits only when everything's there, LRU replacement,
+ * and writes/fills/invalidation keep it coherent.
+ */
+static void test_cache(void)
+{
+        static u8 mem[8192 + 4096];
+        unsigned int n, i, u = IDE_CACHE_UNIT(1, 1);
+        int r;
+
+        n = ide_cache_init(mem, sizeof(mem));
+        CHECK(n == 2 && ide_cache_size(n) <= sizeof(mem), "cache of %d lines", n);
+
+        fill_pattern(wbuf, 32*512, 8);
+        CHECK(!ide_cache_read(u, 100, 4, rbuf), "hit in empty cache");
+        ide_cache_fill(u, 100, 4, wbuf);                /* 100-103: line 96 */
+        memset(rbuf, 0, 4*512);
+        r = ide_cache_read(u, 100, 4, rbuf);
+        CHECK(r && memcmp(rbuf, wbuf, 4*512) == 0, "cache hit data");
+        CHECK(!ide_cache_read(u, 99, 2, rbuf), "partial hit");
+        CHECK(!ide_cache_read(IDE_CACHE_UNIT(1, 0), 100, 4, rbuf), "hit on other drive");
+
+        /* Spanning lines 96 and 104: */
+        ide_cache_fill(u, 104, 2, wbuf + 4*512);
+        memset(rbuf, 0, 6*512);
+        r = ide_cache_read(u, 100, 6, rbuf);
+        CHECK(r && memcmp(rbuf, wbuf, 6*512) == 0, "cache hit across lines");
+
+        /* A fill doesn't replace newer (written) data; a write does */
+        ide_cache_write(u, 101, 1, wbuf + 20*512);
+        ide_cache_fill(u, 100, 4, wbuf);
+        r = ide_cache_read(u, 101, 1, rbuf);
+        CHECK(r && memcmp(rbuf, wbuf + 20*512, 512) == 0, "fill replaced written data");
+
+        ide_cache_invalidate(u, 101, 1);
+        CHECK(!ide_cache_read(u, 100, 2, rbuf) && ide_cache_read(u, 102, 2, rbuf),
+              "invalidate");
+
+        /* Line 96 was used last; a new line replaces 104 */
+        ide_cache_read(u, 102, 1, rbuf);
+        ide_cache_write(u, 200, 1, wbuf);
+        CHECK(!ide_cache_read(u, 104, 1, rbuf), "LRU line kept");
+        CHECK(ide_cache_read(u, 102, 1, rbuf) && ide_cache_read(u, 200, 1, rbuf),
+              "MRU line lost");
+
+        /* A raw write updates what's cached, and allocates nothing */
+        ide_cache_update(u, 102, 1, wbuf + 21*512);
+        ide_cache_update(u, 300, 1, wbuf);
+        r = ide_cache_read(u, 102, 1, rbuf);
+        CHECK(r && memcmp(rbuf, wbuf + 21*512, 512) == 0, "raw write not cached");
+        CHECK(!ide_cache_read(u, 300, 1, rbuf) && ide_cache_read(u, 200, 1, rbuf),
+              "raw write allocated a line");
+
+        ide_cache_purge(u);
+        for (i = 0; i < 256; i++)
+                CHECK(!ide_cache_read(u, i, 1, rbuf), "purged sector %d", i);
+
+        /* Read-ahead: sequential streams are spotted, even interleaved,
+         * and get more each time they come back for it.
+         */
+        ide_ra_note(u, 1000, 16);
+        ide_ra_note(u, 3000, 16);
+        CHECK(ide_ra_want(u, 1016, 64) == 0, "read-ahead for a single read");
+        ide_ra_note(u, 1016, 16);
+        ide_ra_note(u, 3016, 16);
+        ide_ra_note(u, 50, 2);                          /* Random */
+        CHECK(ide_ra_want(u, 1032, 64) == 16, "first read-ahead");
+        CHECK(ide_ra_want(u, 3032, 64) == 16, "interleaved stream");
+        ide_ra_note(u, 1032, 16);
+        CHECK(ide_ra_want(u, 1048, 64) == 32, "read-ahead growth");
+        ide_ra_note(u, 1048, 16);
+        CHECK(ide_ra_want(u, 1064, 40) == 40, "read-ahead limit");
+        CHECK(ide_ra_want(u, 52, 64) == 0, "read-ahead for random read");
+        CHECK(ide_ra_want(IDE_CACHE_UNIT(1, 0), 1064, 64) == 0, "read-ahead, other drive");
+
+        /* No memory, no cache */
+        n = ide_cache_init(mem, 100);
+        ide_cache_fill(u, 100, 4, wbuf);
+        CHECK(n == 0 && !ide_cache_read(u, 100, 4, rbuf), "empty cache");
+}
+
+/* Write-behind: dirty sectors are kept until written back, and written
+ * back in sorted runs.
+ */
+static void test_write_behind(void)
+{
+        static u8 mem[8*4096 + 1024];
+        unsigned int n, i, sector, u = IDE_CACHE_UNIT(0, 1);
+        int r;
+
+        n = ide_cache_init(mem, ide_cache_size(8));
+        CHECK(n == 8, "cache of %d lines", n);
+        fill_pattern(wbuf, 32*512, 9);
+
+        /* Sectors 5-6, 10-17 (written in two pieces) and 30-31 */
+        r = ide_cache_write_behind(u, 10, 4, wbuf);
+        r &= ide_cache_write_behind(u, 14, 4, wbuf + 4*512);
+        r &= ide_cache_write_behind(u, 30, 2, wbuf + 20*512);
+        r &= ide_cache_write_behind(u, 5, 2, wbuf + 24*512);
+        CHECK(r && ide_cache_dirty(u) == 4 && ide_cache_dirty(IDE_CACHE_UNIT(0, 0)) == 0,
+              "dirty lines %d", ide_cache_dirty(u));
+        r = ide_cache_read(u, 10, 8, rbuf);
+        CHECK(r && memcmp(rbuf, wbuf, 8*512) == 0, "read of dirty sectors");
+
+        /* A read from the disc gets the dirty sectors put over it */
+        memset(rbuf, 0, 12*512);
+        ide_cache_overlay(u, 8, 12, rbuf);
+        CHECK(memcmp(rbuf + 2*512, wbuf, 8*512) == 0 && rbuf[0] == 0 &&
+              rbuf[10*512] == 0, "overlay");
+
+        /* Runs are merged across lines, and taken in order from the head */
+        memset(rbuf, 0, 16*512);
+        n = ide_cache_flush_run(u, 12, &sector, rbuf, 16);
+        CHECK(n == 8 && sector == 10 && memcmp(rbuf, wbuf, 8*512) == 0,
+              "first run %d at %d", n, sector);
+        n = ide_cache_flush_run(u, 18, &sector, rbuf, 16);
+        CHECK(n == 2 && sector == 30, "second run %d at %d", n, sector);
+        n = ide_cache_flush_run(u, 32, &sector, rbuf, 16);
+        CHECK(n == 2 && sector == 5, "wrapped run %d at %d", n, sector);
+        n = ide_cache_flush_run(u, 0, &sector, rbuf, 16);
+        CHECK(n == 0 && ide_cache_dirty(u) == 4, "nothing left, %d busy", ide_cache_dirty(u));
+
+        /* Written again while being written back: dirty again after */
+        ide_cache_write_behind(u, 11, 1, wbuf + 28*512);
+        ide_cache_flush_done(u, 10, 8, 1);
+        ide_cache_flush_done(u, 30, 2, 1);
+        ide_cache_flush_done(u, 5, 2, 1);
+        CHECK(ide_cache_dirty(u) == 1, "dirty lines %d after write-back", ide_cache_dirty(u));
+        n = ide_cache_flush_run(u, 0, &sector, rbuf, 16);
+        CHECK(n == 1 && sector == 11 && memcmp(rbuf, wbuf + 28*512, 512) == 0,
+              "rewritten run %d at %d", n, sector);
+        /* A failed write-back loses it */
+        ide_cache_flush_done(u, 11, 1, 0);
+        CHECK(ide_cache_dirty(u) == 0 && !ide_cache_read(u, 11, 1, rbuf) &&
+              ide_cache_read(u, 10, 1, rbuf), "failed write-back");
+
+        /* At most 3/4 of the lines are let get dirty, and they're kept */
+        for (i = 0; i < 6; i++)
+                CHECK(ide_cache_write_behind(u, 1000 + i*8, 8, wbuf), "write-behind %d", i);
+        CHECK(!ide_cache_write_behind(u, 2000, 1, wbuf), "write-behind over limit");
+        for (i = 0; i < 20; i++)
+                ide_cache_fill(u, 3000 + i*8, 8, wbuf);
+        for (i = 0; i < 6; i++)
+                CHECK(ide_cache_read(u, 1000 + i*8, 8, rbuf), "dirty line %d replaced", i);
+        ide_cache_invalidate(u, 1000, 8);
+        CHECK(ide_cache_read(u, 1000, 8, rbuf), "dirty sectors invalidated");
+        ide_cache_purge(u);
+        CHECK(ide_cache_dirty(u) == 0, "purge left dirty lines");
+}
+
+/* CompactFlash: erasing ahead, and writing without erasing */
+static void test_cfa(void)
+{
+        drive_info_t *di = &ide.drives[0];
+        ide_xfer_t *x = &ide.xfer;
+        unsigned int i, irqs;
+        int r;
+
+        r = ide_cfa_erase(&ide, 0, 2000, 8);
+        CHECK(r != 0 && sim_erases == 0, "erase on a non-CFA drive");
+        sim_drv.cfa = 1;
+        r = ide_init(&ide, 0, rbuf);
+        CHECK(r == 1 && (di->feat & IDE_F_CFA), "CFA not detected");
+
+        r = ide_cfa_erase(&ide, 0, 2000, 300);
+        CHECK(r == 0 && sim_erases == 2 && di->nerased == 1 && di->erased[0].start == 2000 &&
+              di->erased[0].end == 2300, "erase (%d, %d commands)", r, sim_erases);
+        CHECK(disc[2000*512] == 0xff && disc[2300*512 - 1] == 0xff, "erased data");
+
+        /* A write inside is told so, and splits the extent */
+        CHECK(ide_erased_take(di, 2100, 50), "write in erased extent");
+        CHECK(di->nerased == 2 && !ide_erased_take(di, 2140, 20),
+              "write over erased extent's edge");
+        CHECK(di->nerased == 2 && !ide_erased_take(di, 2100, 1), "write to written sectors");
+
+        fill_pattern(wbuf, 64*512, 11);
+        x->noerase = ide_erased_take(di, 2000, 64);
+        x->drive = 0;
+        x->sector = 2000;
+        x->count = 64;
+        x->addr = wbuf;
+        x->nsegs = 0;
+        x->write = 1;
+        r = ide_xfer_start(&ide, x);
+        while (r == IDE_XFER_MORE && sim_wait_irq())
+                r = ide_xfer_service(&ide, x);
+        CHECK(r == IDE_XFER_DONE && x->noerase && sim_drv.cmd == WDCC_CFA_WRITE_MULTI_NE &&
+              memcmp(disc + 2000*512, wbuf, 64*512) == 0, "write without erase (%d, %02x)",
+              r, sim_drv.cmd);
+        r = irq_xfer(2000, 64, wbuf, 1, &irqs);
+        CHECK(r == IDE_XFER_DONE && sim_drv.cmd == WDCC_WRITE_MULTI, "ordinary write");
+
+        /* A failed write without erase is retried as an ordinary write */
+        r = ide_cfa_erase(&ide, 0, 2000, 64);
+        fill_pattern(wbuf, 64*512, 15);
+        x->noerase = ide_erased_take(di, 2000, 64);
+        x->sector = 2000;
+        x->count = 64;
+        x->addr = wbuf;
+        x->nsegs = 0;
+        sim_drv.bad_lba = 2040;
+        sim_drv.bad_left = 1;
+        sim_cmds = 0;
+        r = ide_xfer_polled(&ide, x);
+        CHECK(r == IDE_XFER_DONE && sim_cmds == 2 && !x->noerase &&
+              sim_drv.cmd == WDCC_WRITE_MULTI && sim_drv.cmd_lba == 2032 &&
+              memcmp(disc + 2000*512, wbuf, 64*512) == 0,
+              "write without erase retried as %02x from %d", sim_drv.cmd, sim_drv.cmd_lba);
+        sim_drv.bad_left = 0;
+
+        /* Adjacent extents merge; a full table forgets the smallest */
+        ide_erased_add(di, 3000, 10);
+        ide_erased_add(di, 3010, 10);
+        CHECK(di->nerased == 3 && ide_erased_take(di, 3005, 10), "merged extents");
+        for (i = 0; i < 8; i++)
+                ide_erased_add(di, 3100 + i*100, 10 + i);
+        CHECK(di->nerased == IDE_ERASED_MAX && ide_erased_take(di, 3800, 17) &&
+              !ide_erased_take(di, 3005, 1), "full erased table");
+        sim_drv.cfa = 0;
+}
+
+/* A device in the quirk table gets its own limits */
+static const ide_quirk_t sim_quirks[] = {
+        { "SIMULATED QUIRKY", "SIM", IDE_Q_NOMULTI | IDE_Q_NOWCACHE, 16, 2, 5 },
+        { "SIMULATED ANY", 0, 0, 64, IDE_PIO_ANY, 0 },
+        { 0, 0, 0, 0, 0, 0 }
+};
+
+static void test_quirks(void)
+{
+        drive_info_t *di = &ide.drives[0];
+        unsigned int irqs;
+        int r;
+
+        ide_set_quirks(sim_quirks);
+        sim_drv.model = "SIMULATED QUIRKY DISC";
+        ide.features = IDE_F_WCACHE | IDE_F_LOOKAHEAD;
+        r = ide_init(&ide, 0, rbuf);
+        CHECK(r == 1 && di->max_sectors == 16 && di->settle_us == 5, "quirks not applied");
+        CHECK(di->multi == 0 && di->pio_mode == 2 && !sim_drv.wcache && sim_drv.rla,
+              "quirky drive: multiple %d, PIO%d, write cache %d", di->multi, di->pio_mode,
+              sim_drv.wcache);
+
+        fill_pattern(wbuf, 40*512, 12);
+        sim_cmds = 0;
+        r = irq_xfer(100, 40, wbuf, 1, &irqs);
+        CHECK(r == IDE_XFER_DONE && sim_cmds == 3 && sim_drv.cmd == WDCC_WRITE &&
+              memcmp(disc + 100*512, wbuf, 40*512) == 0, "quirky write (%d, %d commands)",
+              r, sim_cmds);
+
+        sim_drv.model = 0;
+        r = ide_init(&ide, 0, rbuf);
+        CHECK(r == 1 && di->max_sectors == 0 && di->quirks == 0 && di->multi == SIM_MULTI_MAX,
+              "quirks left over");
+
+        sim_drv.model = "SIMULATED ANY DISC";
+        r = ide_init(&ide, 0, rbuf);
+        CHECK(r == 1 && di->max_sectors == 64 && di->pio_mode == 4,
+              "no PIO limit: %d sectors, PIO%d", di->max_sectors, di->pio_mode);
+
+        /* The built-in table */
+        ide_set_quirks(0);
+        sim_drv.model = "WDC AC2540H";
+        r = ide_init(&ide, 0, rbuf);
+        CHECK(r == 1 && di->pio_max == 3 && di->pio_mode == 3,
+              "known drive: PIO%d, drive max %d", di->pio_mode, di->pio_max);
+        sim_drv.model = 0;
+}
+
+/* Missing drives are found out without waiting for IDENTIFY to time out */
+static void test_absent(void)
+{
+        unsigned long t;
+        int r;
+
+        ide.features = IDE_F_WCACHE | IDE_F_LOOKAHEAD;
+        t = sim_now;
+        r = ide_init(&ide, 0, rbuf);
+        CHECK(r == 1 && !ide.drives[1].present && sim_now - t < 5000,
+              "missing drive 1 took %luus", sim_now - t);
+
+        /* With SRST, drive 0's signature is checked */
+        ide.ctl_regs = sim_ctlblock;
+        t = sim_now;
+        r = ide_init(&ide, 0, rbuf);
+        CHECK(r == 1 && ide.drives[0].present && !ide.drives[1].present &&
+              sim_now - t < 5000 + SIM_RESET_US, "after reset: %d drives, %luus",
+              r, sim_now - t);
+        sim_drv.atapi = 1;
+        r = ide_init(&ide, 0, rbuf);
+        CHECK(r == 0 && !ide.drives[0].present, "ATAPI device accepted");
+        sim_drv.atapi = 0;
+
+        /* Nothing on the bus at all */
+        sim_drv.empty = 1;
+        t = sim_now;
+        r = ide_init(&ide, 0, rbuf);
+        CHECK(r <= 0 && sim_now - t < 1000, "empty bus: %d, %luus", r, sim_now - t);
+        sim_drv.empty = 0;
+
+        /* Registers, but no drive behind them: BSY isn't waited for */
+        sim_drv.latch = 1;
+        t = sim_now;
+        r = ide_init(&ide, 0, rbuf);
+        CHECK(r == 0 && sim_now - t < 5000, "busy latches: %d, %luus", r, sim_now - t);
+        ide.ctl_regs = 0;
+        t = sim_now;
+        r = ide_init(&ide, 0, rbuf);
+        CHECK(r == 0 && sim_now - t < 5000, "busy latches, no reset: %d, %luus",
+              r, sim_now - t);
+        sim_drv.latch = 0;
+        ide.ctl_regs = 0;
+
+        r = ide_init(&ide, 0, rbuf);
+        CHECK(r == 1 && sim_drv.wcache && sim_drv.rla, "re-init after reset");
+}
+
+/* Errors are retried from the sector that failed, and a hung drive is reset */
+static void test_recovery(void)
+{
+        ide_xfer_t x;
+        unsigned long t;
+        int r;
+
+        ide.features = IDE_F_WCACHE | IDE_F_LOOKAHEAD;
+        r = ide_init(&ide, 0, rbuf);
+        fill_pattern(disc + 200*512, 40*512, 13);
+
+        /* A read that fails once, mid-way */
+        sim_drv.bad_lba = 221;
+        sim_drv.bad_left = 1;
+        sim_cmds = 0;
+        memset(rbuf, 0, 40*512);
+        r = ide_read_some(&ide, 0, 200, 40, rbuf);
+        CHECK(r == 0 && sim_cmds == 2 && sim_drv.cmd_lba == 216 &&
+              memcmp(rbuf, disc + 200*512, 40*512) == 0,
+              "read retry (%d, %d commands, from %d)", r, sim_cmds, sim_drv.cmd_lba);
+
+        /* One that keeps failing gives up, and says where */
+        sim_drv.bad_left = 10;
+        sim_cmds = 0;
+        x.drive = 0;
+        x.sector = 200;
+        x.count = 40;
+        x.addr = rbuf;
+        x.nsegs = 0;
+        x.write = 0;
+        x.noerase = 0;
+        r = ide_xfer_polled(&ide, &x);
+        CHECK(r == IDE_XFER_ERROR && sim_cmds == 1 + IDE_XFER_RETRIES &&
+              x.sector == 216 && x.count == 24 && (x.error & 0xff) == 0x40,
+              "persistent error (%d, %d commands, sector %d)", r, sim_cmds, x.sector);
+
+        /* A write's failed block is sent again, across segments */
+        sim_drv.bad_left = 1;
+        sim_cmds = 0;
+        fill_pattern(wbuf, 40*512, 14);
+        x.sector = 200;
+        x.count = 40;
+        x.write = 1;
+        x.nsegs = 3;
+        x.segs[0].addr = wbuf;
+        x.segs[0].count = 18;
+        x.segs[1].addr = wbuf + 18*512;
+        x.segs[1].count = 3;
+        x.segs[2].addr = wbuf + 21*512;
+        x.segs[2].count = 19;
+        r = ide_xfer_polled(&ide, &x);
+        CHECK(r == IDE_XFER_DONE && sim_cmds == 2 && sim_drv.cmd_lba == 216 &&
+              memcmp(disc + 200*512, wbuf, 40*512) == 0,
+              "write retry (%d, %d commands, from %d)", r, sim_cmds, sim_drv.cmd_lba);
+        sim_drv.bad_left = 0;
+
+        /* A hung drive is reset and set up again */
+        ide.ctl_regs = sim_ctlblock;
+        sim_drv.hang = 1;
+        t = sim_now;
+        memset(rbuf, 0, 40*512);
+        r = ide_read_some(&ide, 0, 200, 40, rbuf);
+        CHECK(r == 0 && memcmp(rbuf, disc + 200*512, 40*512) == 0 &&
+              sim_drv.multi == SIM_MULTI_MAX && sim_drv.wcache && sim_drv.rla &&
+              sim_drv.xfer_mode == (WDSF_MODE_PIO | 4),
+              "after reset: %d, multiple %d, wcache %d", r, sim_drv.multi, sim_drv.wcache);
+        /* Hung before the first block: that can't be told from spinning up */
+        CHECK(sim_now - t < (IDE_TMO_LONG + 100)*1000, "recovery took %luus", sim_now - t);
+
+        /* Without a control block, a hung drive can't be reset, so that's it */
+        ide.ctl_regs = 0;
+        sim_drv.hang = 1;
+        sim_cmds = 0;
+        t = sim_now;
+        r = ide_read_some(&ide, 0, 200, 40, rbuf);
+        CHECK(r != 0 && sim_cmds == 1 && sim_now - t < (IDE_TMO_LONG + 50)*1000,
+              "no reset: %d, %d commands, %luus", r, sim_cmds, sim_now - t);
+        sim_drv.status = WDCS_READY;
+}
+
+/* Timeouts are real times, whatever the speed of the polling loop */
+static void test_timeouts(void)
+{
+        ide_xfer_t x;
+        unsigned long t;
+        int r;
+
+        ide_calibrate(&ide);
+        CHECK(ide.loops_ms == 1000, "calibrated %d loops/ms", ide.loops_ms);
+        sim_drv.status = WDCS_BUSY;
+        t = sim_now;
+        r = ide_wait_nbsy(&ide, IDE_TMO_SHORT);
+        CHECK(r == -1 && sim_now - t >= IDE_TMO_SHORT*1000 &&
+              sim_now - t < IDE_TMO_SHORT*1100, "short timeout took %luus", sim_now - t);
+
+        /* A slower bus: fewer turns of the loop in the same time */
+        sim_reg_us = 3;
+        ide_calibrate(&ide);
+        CHECK(ide.loops_ms == 250, "slow bus calibrated %d loops/ms", ide.loops_ms);
+        t = sim_now;
+        r = ide_wait_nbsy(&ide, IDE_TMO_MEDIUM);
+        CHECK(r == -1 && sim_now - t >= IDE_TMO_MEDIUM*1000 &&
+              sim_now - t < IDE_TMO_MEDIUM*1100, "medium timeout took %luus", sim_now - t);
+        sim_reg_us = 0;
+        sim_drv.status = WDCS_READY;
+        ide_calibrate(&ide);
+
+        /* The first block after a command may wait for the drive to spin
+         * up from standby; later ones get the usual timeout.
+         */
+        fill_pattern(wbuf, 8*512, 13);
+        sim_drv.spinup = 5000000;
+        sim_cmds = 0;
+        t = sim_now;
+        r = ide_write_some(&ide, 0, 300, 8, wbuf);
+        CHECK(r == 0 && sim_cmds == 1 && sim_now - t >= 5000000 &&
+              memcmp(disc + 300*512, wbuf, 8*512) == 0,
+              "write after standby: %d, %d commands", r, sim_cmds);
+        sim_drv.spinup = 5000000;
+        sim_cmds = 0;
+        r = ide_read_some(&ide, 0, 300, 8, rbuf);
+        CHECK(r == 0 && sim_cmds == 1 && memcmp(rbuf, wbuf, 8*512) == 0,
+              "read after standby: %d, %d commands", r, sim_cmds);
+        x.first = 0;
+        CHECK(ide_xfer_tmo(&x) == IDE_TMO_MEDIUM, "timeout between blocks");
+        x.first = 1;
+        CHECK(ide_xfer_tmo(&x) == IDE_TMO_LONG, "timeout for a first block");
+}
+
+int main(void)
+{
+        disc = calloc(SIM_SECTORS, 512);
+        sim_drv.disc = disc;
+        sim_drv.status = WDCS_READY;
+
+        test_init();
+        test_polled();
+        test_lba48();
+        test_irq();
+        test_single();
+        test_window();
+        test_shadow();
+        test_chs();
+        test_segments();
+        test_nowait();
+        test_poll_ticks();
+        test_yield();
+        test_cache();
+        test_write_behind();
+        test_cfa();
+        test_quirks();
+        test_absent();
+        test_recovery();
+        test_timeouts();
+
+        printf("%s (%d failure%s)\n", failures ? "FAILED" : "PASSED", failures,
+               failures == 1 ? "" : "s");
+        return failures ? 1 : 0;
+}
@@ -30,6 +30,19 @@ void DELAY_(int d)
         }
 }
 
+/* Nothing else to run; just spin */
+int ide_yield(ide_host_t *ih)
+{
+        return 0;
+}
+
+/* No fine-grained clock from user mode: waits assume 1us per poll */
+unsigned int ide_timer(unsigned int *period)
+{
+        *period = 0;
+        return 0;
+}
+
 #define A5K 0x3010000 + (0x1f0*4); // Internal IDE on A5000
 
 static uint8_t buffer[512];
@@ -93,6 +106,8 @@ int main(void)
         int i;
 
         ide.regs = (regs_t)(XCB_ADDRESS(XCB_SPEED_SLOW, 0) + 0x3000);
+        ide.pio_max = 4;        /* As for HOST_ZIDEFS in ecide.c */
+        ide.features = IDE_F_WCACHE | IDE_F_LOOKAHEAD;  /* As ecide_features */
 
         printf("Hello from C! Probing IDE at %p:\n\n", ide.regs);
 